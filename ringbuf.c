@@ -1,11 +1,59 @@
+#define _GNU_SOURCE     // memfd_create()
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef RB_IO_URING
+#include <liburing.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "ringbuf.h"
 #include "ringbuf_core.h"
 
+// 按buffer的记录格式保留一个item并写入header
+static struct ringbuf_item *
+rb_reserve_item(struct ringbuf *buffer, u32 type, u32 length)
+{
+    struct ringbuf_item *item;
+    u64 ts;
+
+    if (!length) 
+        length += 1;
+    if (length > RB_ITEM_MAX_DATA(buffer))
+        return NULL;
+    if (rb_sample_skip(buffer, type))
+        return NULL;
+
+    rb_lock(buffer);
+    if (rb_stopped(buffer)) {
+        rb_unlock(buffer);
+        return NULL;
+    }
+    ts = rb_clock(buffer);
+    if (rb_mirror(buffer))
+        item = rb_mirror_reserve(buffer, rb_item_space(buffer, length));
+    else
+        item = rb_reserve_space(buffer, rb_item_space(buffer, length), type, ts);
+    if (!item) {
+        rb_unlock(buffer);
+        return NULL;
+    }
+    rb_write_item_hdr(buffer, item, type, length, RB_FRAG_NONE,
+            rb_mirror(buffer) ? 0 : ts - buffer->tail_page->page->time_stamp);
+    rb_trigger_note(buffer, type, rb_entry_data(buffer, item), length);
+
+    return item;
+}
+
 /**
  * @brief reserve a part of the buffer
  * @param buffer 
@@ -13,39 +61,140 @@
  * 
  * 返回一个对应于保留区域的ring buffer 子项结构，caller可直接向其成员
  * `->data`指向的位置写入长度为length的数据
+ * 
+ * length超过一个page所能容纳的长度时返回NULL, 这样的大记录只能通过
+ * ringbuf_write() 拆分成多个分片写入.
  */
 struct ringbuf_item *
 ringbuf_reserve_item(struct ringbuf *buffer, u32 length)
 {
-    struct buf_page_meta *tail_page;
-    struct ringbuf_item *item;
-    u32 tail;
+    // 固定长度记录及紧凑header不使用ringbuf_item, 使用 ringbuf_reserve()
+    assert(rb_std_hdr(buffer));
 
-    if (!length) 
-        length += 1;
-    length += RB_ITEM_HDR_SIZE;
-    length = ALIGN_UP(length, RB_ARCH_ALIGNMENT);
+    return rb_reserve_item(buffer, 0, length);
+}
 
-    // no enough space for this page
-    if (length + rb_page_write(buffer->tail_page) > BUF_PAGE_SIZE) {
-        if (rb_move_tail(buffer, length)) {
-            ringbuf_show_state(buffer);
-            assert(0);
+/**
+ * @brief reserve a part of the buffer, 适用于所有记录格式
+ * @param length length of the data to reserve
+ * 
+ * 返回数据区的指针, caller写入长度为length的数据后调用
+ * ringbuf_commit_data(). 固定长度记录模式下length必须等于
+ * record_size, 否则返回NULL.
+ */
+void *ringbuf_reserve(struct ringbuf *buffer, u32 length)
+{
+    return ringbuf_reserve_type(buffer, 0, length);
+}
+
+/**
+ * @brief 同 ringbuf_reserve(), 并指定记录的type
+ * @param type 0 ~ RB_NR_TYPES-1, 固定长度记录没有type, 只能为0
+ */
+void *ringbuf_reserve_type(struct ringbuf *buffer, u32 type, u32 length)
+{
+    struct ringbuf_item *item;
+    void *record;
+
+    assert(type < RB_NR_TYPES);
+    if (rb_fixed(buffer)) {
+        assert(type == 0);
+        if (length != buffer->record_size)
+            return NULL;
+        if (rb_sample_skip(buffer, 0))
+            return NULL;
+        rb_lock(buffer);
+        if (rb_stopped(buffer)) {
+            rb_unlock(buffer);
+            return NULL;
         }
+        record = rb_reserve_space(buffer, rb_fixed_space(buffer), 0,
+                rb_clock(buffer));
+        if (!record) {
+            rb_unlock(buffer);
+            return NULL;
+        }
+        rb_trigger_note(buffer, 0, record, length);
+        return record;
+    }
+
+    item = rb_reserve_item(buffer, type, length);
+    return item ? rb_entry_data(buffer, item) : NULL;
+}
+
+/*
+ * 将超过一个page的记录拆分成分片写入连续的page.
+ * 第一个分片使用tail_page剩余的空间, 之后的分片都从page起始处开始,
+ * 除最后一个分片外都会填满所在的page.
+ * 记录只在最后一个分片写入后才 commit, 因此reader不会看到写了一半的记录.
+ */
+static int
+rb_write_frags(struct ringbuf *buffer, u32 type, u32 length, void *data)
+{
+    struct buf_page_meta *tail_page;
+    struct ringbuf_item *item = NULL;
+    int frag = RB_FRAG_FIRST;
+    u32 space, chunk;
+    u64 ts;
+
+    if (rb_sample_skip(buffer, type))
+        return 1;
+    rb_lock(buffer);
+    if (rb_stopped(buffer)) {
+        rb_unlock(buffer);
+        return 1;
+    }
+    rb_trigger_note(buffer, type, data, length);
+    if (!rb_frags_fit(buffer, length)) {
+        rb_debug("[w] no room for 0x%x bytes record\n", length);
+        rb_unlock(buffer);
+        return 1;
     }
-    rb_debug("[w] write in 0x%x bytes, remain 0x%lx bytes in current tail_page\n",
-            length, BUF_PAGE_SIZE-length-rb_page_write(buffer->tail_page));
 
-    tail_page = buffer->tail_page;
-    tail = tail_page->write;
+    ts = rb_clock(buffer);
+    while (length) {
+        tail_page = buffer->tail_page;
+        space = BUF_PAGE_SIZE - rb_page_write(tail_page);
+        if (space < rb_item_space(buffer, 1) ||
+                !rb_item_max_data(buffer, space) ||
+                rb_page_delta_overflow(buffer, tail_page, ts)) {
+            // 先发布本page上已写入的分片, 再移动tail_page
+            tail_page->page->commit = rb_page_write(tail_page);
+            if (rb_move_tail(buffer, rb_item_space(buffer, 1))) {
+                // rb_frags_fit() 已经检查过, 不应该发生
+                rb_debug("[w] no room for the rest 0x%x bytes\n", length);
+                rb_unlock(buffer);
+                return -1;
+            }
+            continue;
+        }
 
-    tail_page->write += length;
-    tail_page->nr_entry += 1;
+        chunk = MIN(length, rb_item_max_data(buffer, space));
+        if (chunk == length)
+            frag = RB_FRAG_LAST;
 
-    item = rb_page_index(tail_page, tail);
-    rb_init_item(item, 0, length);
+        // 后续分片所在page上第一条完整的记录是下一条记录
+        rb_page_note(buffer, tail_page,
+                buffer->nr_entry + (frag != RB_FRAG_FIRST), ts);
+        item = rb_page_index(tail_page, tail_page->write);
+        rb_write_item_hdr(buffer, item, type, chunk, frag,
+                ts - tail_page->page->time_stamp);
+        rb_copy_data(buffer, rb_entry_data(buffer, item), data, chunk);
 
-    return item;
+        tail_page->write += rb_item_length(buffer, item);
+        if (frag == RB_FRAG_FIRST) {
+            tail_page->nr_entry += 1;
+            tail_page->types |= RB_TYPE_MASK(type);
+        }
+        rb_debug("[w] write in fragment(%d) of 0x%x bytes\n", frag, chunk);
+
+        data = (u8 *)data + chunk;
+        length -= chunk;
+        frag = RB_FRAG_MIDDLE;
+    }
+
+    rb_commit(buffer, item);
+    return 0;
 }
 
 /**
@@ -59,6 +208,14 @@ void ringbuf_commit(struct ringbuf *buffer,
     rb_commit(buffer, item);
 }
 
+/**
+ * @brief 提交 ringbuf_reserve() 保留的数据
+ */
+void ringbuf_commit_data(struct ringbuf *buffer, void *data)
+{
+    rb_commit(buffer, NULL);
+}
+
 
 /**
  * @brief return an item and consume it
@@ -75,191 +232,1835 @@ ringbuf_consume(struct ringbuf *buffer)
 {
     struct ringbuf_item *item;
 
+    // 固定长度记录及紧凑header不使用ringbuf_item, 使用 ringbuf_consume_entry()
+    assert(rb_std_hdr(buffer));
+
+    rb_reader_lock(buffer);
     item = rb_buf_peek(buffer);
     if (item)
         rb_advance_reader(buffer);
+    rb_reader_unlock(buffer);
     return item;
 }
 
-void *ringbuf_item_data(struct ringbuf_item *item)
+/**
+ * @brief 查看下一条记录, 不消费, 适用于所有记录格式
+ * 
+ * Return 0 if no readable data.
+ */
+int ringbuf_peek_entry(struct ringbuf *buffer, struct ringbuf_entry *entry)
 {
-    return rb_item_data(item);
+    struct ringbuf_item *item;
+
+    rb_reader_lock(buffer);
+    item = rb_buf_peek(buffer);
+    if (item) {
+        rb_item_to_entry(buffer, buffer->reader_page, item, entry);
+        entry->seq = buffer->nr_read;
+    }
+    rb_reader_unlock(buffer);
+    return item != NULL;
 }
 
-u32 ringbuf_item_data_length(struct ringbuf_item *item)
+/**
+ * @brief 消费下一条记录, 适用于所有记录格式
+ * @param entry 返回记录的数据、长度和类型
+ * 
+ * 数据的有效期与 ringbuf_consume() 相同. 跨page的大记录只返回
+ * 第一个分片(整条记录都会被消费).
+ * 
+ * Return 0 if no readable data.
+ */
+int ringbuf_consume_entry(struct ringbuf *buffer, struct ringbuf_entry *entry)
 {
-    u32 length;
+    struct ringbuf_item *item;
 
-    length = rb_item_length(item);
-    rb_debug("ORIGIN lengeth: %d\n", length);
-    return length-RB_ITEM_HDR_SIZE;
+    rb_reader_lock(buffer);
+    item = rb_buf_peek(buffer);
+    if (item) {
+        rb_item_to_entry(buffer, buffer->reader_page, item, entry);
+        entry->seq = buffer->nr_read;
+        rb_advance_reader(buffer);
+    }
+    rb_reader_unlock(buffer);
+    return item != NULL;
 }
 
+/**
+ * @brief 同 ringbuf_consume_entry(), 但记录所在的page在 ringbuf_release()
+ *        之前不会被writer重新使用, entry->data 一直有效
+ * 
+ * 可以连续取出一批记录交给其他线程处理而不拷贝. 被持有的page仍按顺序
+ * 放回环中, writer到达这个page时写入失败(同buffer写满), 因此持有的记录
+ * 越久, buffer可用的空间越少.
+ * 
+ * 跨page的记录不会被消费, 返回-1, caller可以用 ringbuf_consume_copy()
+ * 或 ringbuf_consume_sg() 取出它之后继续. Return 0 if no readable data.
+ */
+int ringbuf_consume_hold(struct ringbuf *buffer, struct ringbuf_entry *entry)
+{
+    struct ringbuf_item *item;
+    int ret = 0;
 
-/* 
- * write data to the buffer without reserving
- *
- * This is like ring_buffer_lock_reserve and ring_buffer_unlock_commit as
- * one function. If you already have the data to write to the buffer, it
- * may be easier to simply call this function.
+    assert(!rb_mirror(buffer));
+    rb_reader_lock(buffer);
+    item = rb_buf_peek(buffer);
+    if (item && rb_item_has_next_frag(buffer, item)) {
+        ret = -1;
+    } else if (item) {
+        rb_item_to_entry(buffer, buffer->reader_page, item, entry);
+        entry->seq = buffer->nr_read;
+        __atomic_add_fetch(&entry->page->hold, 1, __ATOMIC_RELAXED);
+        rb_advance_reader(buffer);
+        ret = 1;
+    }
+    rb_reader_unlock(buffer);
+    return ret;
+}
+
+/**
+ * @brief 释放 ringbuf_consume_hold() 返回的记录
  * 
- * Note, like ring_buffer_lock_reserve, the length is the length of the data
- * and not the length of the event which would hold the header.
+ * 每条记录释放一次, 可以在任意线程中以任意顺序调用. 同一page上的记录
+ * 都释放后writer才能重新使用该page.
  */
-int
-ringbuf_write(struct ringbuf *buffer, u32 length, void *data)
+void ringbuf_release(struct ringbuf *buffer, const struct ringbuf_entry *entry)
+{
+    (void)buffer;
+    assert(entry->page && entry->page->hold);
+    // release: 对记录的访问都在writer重新写入该page之前完成
+    __atomic_sub_fetch(&entry->page->hold, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 初始化迭代器, 从下一条未消费的记录开始遍历
+ * 
+ * 迭代器不消费数据. 遍历期间不能消费记录, 以免记录所在的page被writer
+ * 重新使用.
+ */
+void ringbuf_iter_start(struct ringbuf_iter *iter, struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader;
+
+    assert(!rb_mirror(buffer));
+    // 先跳过过期的page, 之后的page都更新
+    if (buffer->max_age) {
+        rb_expire_refresh(buffer);
+        rb_get_reader_page(buffer);
+    }
+    reader = buffer->reader_page;
+    iter->buffer = buffer;
+    iter->page = reader;
+    iter->head = reader->read;
+    iter->seq = buffer->nr_read;
+    iter->hist = buffer->hist_tail;
+}
+
+/**
+ * @brief 初始化迭代器, 从history中最旧的page开始遍历
+ * 
+ * history中的page按需解压, 遍历完后从reader_page上第一条记录(包括已经
+ * 消费的记录)继续, 之后与 ringbuf_iter_start() 相同. 因校验失败或过期被
+ * 跳过的page不在history中, 记录的序号会不连续.
+ * 同一时刻只能有一个迭代器遍历history, ringbuf_seek_seq()/ringbuf_seek_time()
+ * 只在环中查找.
+ */
+void ringbuf_iter_history(struct ringbuf_iter *iter, struct ringbuf *buffer)
+{
+    assert(!rb_mirror(buffer));
+    if (buffer->max_age) {
+        rb_expire_refresh(buffer);
+        rb_get_reader_page(buffer);
+    }
+    iter->buffer = buffer;
+    iter->hist = buffer->hist_head;
+    if (!buffer->hist) {
+        rb_iter_set_reader(iter);
+        return;
+    }
+    rb_iter_next_hist(iter);
+}
+
+/**
+ * @brief 返回迭代器当前位置的记录并前进, entry 同 ringbuf_peek_entry()
+ * 
+ * Return 0 if no more data.
+ */
+int ringbuf_iter_next(struct ringbuf_iter *iter, struct ringbuf_entry *entry)
 {
     struct ringbuf_item *item;
-    void *body;
 
-    item = ringbuf_reserve_item(buffer, length);
+    item = rb_iter_peek(iter);
     if (!item)
-        return 1;
-    /* printf("write to item: 0x%p\n", item); */
-    
-    body = rb_item_data(item);
-    memcpy(body, data, length);
+        return 0;
+    rb_item_to_entry(iter->buffer, iter->page, item, entry);
+    entry->seq = iter->seq;
+    rb_iter_advance(iter, item);
+    return 1;
+}
 
-    rb_commit(buffer, item);
+/**
+ * @brief 同 ringbuf_iter_next(), 但只返回type属于mask的记录
+ * @param mask type的位图, 参考 RB_TYPE_MASK()
+ * 
+ * 不含匹配记录的page整页跳过, 不解析其中的header.
+ * Return 0 if no more matching data.
+ */
+int ringbuf_iter_next_filter(struct ringbuf_iter *iter, u32 mask,
+        struct ringbuf_entry *entry)
+{
+    struct ringbuf *buffer = iter->buffer;
+    struct buf_page_meta *bpage;
+    struct ringbuf_item *item;
 
-    return 0;
+    for (;;) {
+        bpage = iter->page;
+        if (iter->head < rb_page_size(bpage) &&
+                rb_page_skippable(buffer, bpage, mask)) {
+            iter->head = rb_page_size(bpage);
+            iter->seq = bpage->seq + bpage->nr_entry;
+        }
+        item = rb_iter_peek(iter);
+        if (!item)
+            return 0;
+        if (mask & RB_TYPE_MASK(rb_entry_type(buffer, item)))
+            break;
+        rb_iter_advance(iter, item);
+    }
+
+    rb_item_to_entry(buffer, iter->page, item, entry);
+    entry->seq = iter->seq;
+    rb_iter_advance(iter, item);
+    return 1;
 }
 
-static void 
-free_buf_page(struct buf_page_meta *bpage)
+/**
+ * @brief 初始化多个buffer的合并读取
+ * @param buffers 需要合并的buffer, 最多 RB_MERGE_MAX 个, 都需要 RB_FL_TIMESTAMP
+ * 
+ * 只支持逐条记录时间戳的标准header: 紧凑header和固定长度记录只有page的
+ * 时间戳, 同一page上的记录无法与其他buffer正确排序.
+ */
+void ringbuf_merge_init(struct ringbuf_merge *merge, struct ringbuf **buffers,
+        u32 nr)
 {
-#ifdef RB_ALLOC_DYNAMIC
-    free(bpage->page);
-    free(bpage);
-#endif
+    assert(nr <= RB_MERGE_MAX);
+
+    merge->nr_buffer = nr;
+    merge->nr_heap = 0;
+    merge->in_heap = 0;
+    merge->pending = -1;
+    for (u32 i = 0; i < nr; i++) {
+        assert(rb_item_ts(buffers[i]));
+        merge->buffers[i] = buffers[i];
+        rb_merge_push(merge, i);
+    }
 }
 
 /**
- * @brief allocate and init a ringbuffer
+ * @brief 按时间戳顺序返回所有buffer中的下一条记录
+ * @param entry 同 ringbuf_peek_entry(), 数据不拷贝
+ * @param index 非NULL时返回记录所在buffer的下标
  * 
- * @param size 
- * @return struct ringbuf* 
+ * 用小顶堆维护各buffer下一条记录的时间戳. 返回的记录在下一次调用时
+ * 才被消费, 因此entry在此之前始终有效. 之前为空的buffer在每次调用时
+ * 重新检查.
+ * 
+ * Return 0 if no readable data in all buffers.
  */
-struct ringbuf *ringbuf_alloc(u32 size)
+int ringbuf_merge_next(struct ringbuf_merge *merge, struct ringbuf_entry *entry,
+        u32 *index)
 {
     struct ringbuf *buffer;
-    struct buf_page_meta *bpage;
-    struct buf_page *page;
-    u32 nr_pages;
-    int ret;
+    u32 idx;
 
-    nr_pages = DIV_ROUND_UP(size, BUF_PAGE_SIZE);
-    if (nr_pages < 2)
-        nr_pages = 2;
+    // 消费上一次返回的记录, 它总在堆顶
+    if (merge->pending >= 0) {
+        buffer = merge->buffers[merge->pending];
+        rb_advance_reader(buffer);
+        rb_merge_pop(merge);
+        rb_merge_push(merge, merge->pending);
+        merge->pending = -1;
+    }
 
-#ifdef RB_ALLOC_DYNAMIC
-    buffer = malloc(sizeof(*buffer));
-    if (!buffer)  assert(0);
+    for (idx = 0; idx < merge->nr_buffer; idx++) {
+        if (!(merge->in_heap & (1u << idx)))
+            rb_merge_push(merge, idx);
+    }
+    if (!merge->nr_heap)
+        return 0;
 
-    // allocate reader page alone
-    bpage = calloc(1, sizeof(*bpage));
-    if (!bpage)  assert(0);
-    page = malloc(PAGE_SIZE);
-    if (!page) assert(0);
-#else
-    buffer = &g_buffer;
-    bpage = &g_bpage[g_page_idx];
-    page = (struct buf_page *)&g_page[g_page_idx];
-    g_page_idx ++;
-#endif
+    idx = merge->heap[0];
+    if (!ringbuf_peek_entry(merge->buffers[idx], entry))
+        assert(0);
+    merge->pending = idx;
+    if (index)
+        *index = idx;
+    return 1;
+}
 
-    bpage->page = page;
-    buffer->reader_page = bpage;
-    rb_init_page(page);
+/**
+ * @brief 将迭代器定位到序号为seq的记录, 之后 ringbuf_iter_next() 返回该记录
+ * 
+ * 记录的序号从0开始, 按写入顺序递增(参考 ringbuf_entry.seq).
+ * 先用page索引二分查找该记录所在的page, 再在page内顺序查找.
+ * 
+ * Return 0 if the record is already consumed or not written yet.
+ */
+int ringbuf_seek_seq(struct ringbuf_iter *iter, u64 seq)
+{
+    struct ringbuf *buffer = iter->buffer;
+    struct buf_page_meta *bpage;
+    struct ringbuf_item *item;
+    u32 lo = 0, hi, mid;
 
-    INIT_LIST_HEAD(&buffer->reader_page->list);
+    ringbuf_iter_start(iter, buffer);
+    if (seq < buffer->nr_read || seq >= buffer->nr_entry)
+        return 0;
 
-    // allocate other pages
-    ret = rb_allocate_pages(buffer, nr_pages);
-    if (ret < 0)
-        assert(0);
+    // 查找最后一个 bpage->seq <= seq 的page
+    hi = rb_nr_ring_pages(buffer);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        bpage = rb_ring_page(buffer, mid);
+        if (!rb_page_empty(buffer, bpage) && bpage->seq <= seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo)
+        rb_iter_set_page(iter, rb_ring_page(buffer, lo - 1));
 
-    buffer->head_page = list_entry(buffer->pages, struct buf_page_meta, list);
-    buffer->tail_page = buffer->head_page;
-    
-    rb_head_page_activate(buffer);
-    
-    return buffer;
+    while (iter->seq < seq) {
+        item = rb_iter_peek(iter);
+        assert(item);
+        rb_iter_advance(iter, item);
+    }
+    return 1;
 }
 
 /**
- * @brief free the ringbuffer
+ * @brief 将迭代器定位到第一条时间戳不小于ts的记录
  * 
- * @param buffer 
+ * 需要 RB_FL_TIMESTAMP. 先按page记录的最后时间戳二分查找page;
+ * 标准header的item带有时间戳增量, 可以继续在page内定位到记录,
+ * 其它格式只能定位到page的起始处.
+ * 
+ * Return 0 if no such record.
  */
-void ringbuf_free(struct ringbuf *buffer)
+int ringbuf_seek_time(struct ringbuf_iter *iter, u64 ts)
 {
-    struct list_head *head = buffer->pages;
-    struct buf_page_meta *bpage, *tmp;
+    struct ringbuf *buffer = iter->buffer;
+    struct buf_page_meta *reader = buffer->reader_page;
+    struct buf_page_meta *bpage;
+    struct ringbuf_item *item;
+    struct ringbuf_entry entry;
+    u32 lo = 0, hi, mid;
 
-    // clear flag 才可以使用list_for_each
-    rb_head_page_deactivate(buffer);
-    if (head) {
-        list_for_each_entry_safe(bpage, tmp, head, list) {
-            list_del_init(&bpage->list);
-            free_buf_page(bpage);
+    assert(buffer->flags & RB_FL_TIMESTAMP);
+
+    ringbuf_iter_start(iter, buffer);
+    if (reader->read >= rb_page_size(reader) || reader->last_stamp < ts) {
+        // 查找第一个 bpage->last_stamp >= ts 的page
+        hi = rb_nr_ring_pages(buffer);
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            bpage = rb_ring_page(buffer, mid);
+            if (rb_page_empty(buffer, bpage) || bpage->last_stamp >= ts)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
-        bpage = list_entry(head, struct buf_page_meta, list);
-        free_buf_page(bpage);
+        if (lo == rb_nr_ring_pages(buffer))
+            return 0;
+        rb_iter_set_page(iter, rb_ring_page(buffer, lo));
     }
-#ifdef RB_ALLOC_DYNAMIC
-    free(buffer);
-#endif
+
+    while ((item = rb_iter_peek(iter))) {
+        if (!rb_item_ts(buffer))
+            return 1;
+        rb_item_to_entry(buffer, iter->page, item, &entry);
+        if (entry.ts >= ts)
+            return 1;
+        rb_iter_advance(iter, item);
+    }
+    return 0;
 }
 
-/*
- * print some state of ringbuffer 
+/**
+ * @brief 消费下一条type属于mask的记录, 之前不匹配的记录都被丢弃
+ * @param mask type的位图, 参考 RB_TYPE_MASK()
+ * 
+ * 不含匹配记录的page整页丢弃, 不解析其中的header.
+ * Return 0 if no matching data, 此时所有可读的记录都已被丢弃.
  */
-void ringbuf_show_state(struct ringbuf *buffer)
+int ringbuf_consume_filter(struct ringbuf *buffer, u32 mask,
+        struct ringbuf_entry *entry)
 {
-    struct list_head *p, *tmp;
-    struct buf_page_meta *page;
-
-    rb_debug("ringbuf hdr:\n");
-    rb_debug("- nr_page: %d\n", buffer->nr_page);
-    rb_debug("- nr_entry: %d\n", buffer->nr_entry);
-    rb_debug("- nr_read: %d\n", buffer->nr_read);
-    rb_debug("- reader_page: <0x%lx>\n", (unsigned long)buffer->reader_page);
-    rb_debug("- head_page: <0x%lx>\n", (unsigned long)buffer->head_page);
-    rb_debug("- tail_page: <0x%lx>\n", (unsigned long)buffer->tail_page);
+    struct ringbuf_item *item;
 
-    rb_debug("- entryof pages:\n");
-    p = buffer->pages;
-    tmp = p;
-    do {
-        page = list_entry(tmp, struct buf_page_meta, list);
-        rb_debug("   <%p>, write: 0x%x, read: 0x%x\n", 
-                page, page->write, page->read);
-        tmp = rb_list_head(tmp->next);
-    } while (tmp != p);
+    assert(!rb_mirror(buffer));
+    rb_reader_lock(buffer);
+    while ((item = rb_buf_peek(buffer))) {
+        if (rb_page_skippable(buffer, buffer->reader_page, mask)) {
+            rb_skip_reader_page(buffer);
+            continue;
+        }
+        if (mask & RB_TYPE_MASK(rb_entry_type(buffer, item))) {
+            rb_item_to_entry(buffer, buffer->reader_page, item, entry);
+            entry->seq = buffer->nr_read;
+            rb_advance_reader(buffer);
+            break;
+        }
+        rb_advance_reader(buffer);
+    }
+    rb_reader_unlock(buffer);
+    return item != NULL;
 }
 
-
-#if 0
 /**
- * ring_buffer_iter_empty - check if an iterator has no more to read
+ * @brief 固定长度记录模式下批量消费记录
+ * @param records 返回各记录数据的指针
+ * @param nr      records数组的容量
+ * 
+ * 只返回当前reader page上连续的记录, 各记录的位置直接由下标计算,
+ * 不解析任何header. 返回消费的记录数, 0 if no readable data.
  */
-int ringbuf_iter_empty(struct ringbuf_iter *iter)
+u32 ringbuf_consume_records(struct ringbuf *buffer, void **records, u32 nr)
 {
-    struct ringbuf *buffer;
     struct buf_page_meta *reader;
-    struct buf_page_meta *head_page, *commit_page;
-    u32 commit;
+    u32 avail, first;
 
-    buffer = iter->buffer;
+    assert(rb_fixed(buffer));
 
+    rb_reader_lock(buffer);
+    if (!rb_buf_peek(buffer)) {
+        rb_reader_unlock(buffer);
+        return 0;
+    }
     reader = buffer->reader_page;
-    head_page = buffer->head_page;
-    commit = rb_page_commit(commit_page);
-    return ((iter->head_page == commit_page && iter->head == commit) ||
-            (iter->head_page == reader && commit_page == head_page &&
-             head_page->read == commit &&
-             iter->head == rb_page_commit(buffer->reader_page)));
+
+    first = (reader->read - rb_page_start(buffer)) / rb_fixed_space(buffer);
+    avail = (rb_page_commit(reader) - reader->read) / rb_fixed_space(buffer);
+    nr = MIN(nr, MIN(avail, rb_num_of_entry(buffer)));
+    for (u32 i = 0; i < nr; i++)
+        records[i] = rb_fixed_index(buffer, reader, first + i);
+
+    if (buffer->flags & RB_FL_LATENCY) {
+        u64 now = buffer->clock();
+        for (u32 i = 0; i < nr; i++)
+            rb_lat_consume(buffer, buffer->nr_read + i, now);
+    }
+    rb_reader_page_advance(buffer, rb_fixed_space(buffer), nr);
+    rb_reader_unlock(buffer);
+    return nr;
+}
+/*
+ * 收集下一条记录的所有分片, 不消费.
+ * 返回分片数, 最多填充nr_sg个; *length 返回记录的总数据长度.
+ * 后续分片总是位于 reader 视角的下一个page的起始处.
+ */
+static u32
+rb_peek_frags(struct ringbuf *buffer, struct ringbuf_sg *sg, u32 nr_sg,
+        u32 *length)
+{
+    struct buf_page_meta *bpage;
+    struct ringbuf_item *item;
+    u32 n = 0;
+
+    assert(!rb_mirror(buffer));
+    *length = 0;
+    item = rb_buf_peek(buffer);
+    if (!item)
+        return 0;
+
+    bpage = buffer->reader_page;
+    for (;;) {
+        if (n < nr_sg) {
+            sg[n].data = rb_entry_data(buffer, item);
+            sg[n].len = rb_entry_length(buffer, item);
+        }
+        n++;
+        *length += rb_entry_length(buffer, item);
+        if (!rb_item_has_next_frag(buffer, item))
+            break;
+        bpage = rb_read_next_page(buffer, bpage);
+        item = rb_page_index(bpage, rb_page_start(buffer));
+    }
+    return n;
+}
+
+/**
+ * @brief 查看下一条记录的总数据长度, 不消费
+ * @param nr_frag 非NULL时返回该记录的分片数
+ * 
+ * Return 0 if no readable data.
+ */
+u32 ringbuf_peek_length(struct ringbuf *buffer, u32 *nr_frag)
+{
+    u32 length, n;
+
+    rb_reader_lock(buffer);
+    n = rb_peek_frags(buffer, NULL, 0, &length);
+    rb_reader_unlock(buffer);
+    if (nr_frag)
+        *nr_frag = n;
+    return length;
+}
+
+/**
+ * @brief 以分片列表的形式消费下一条记录, 不拷贝数据
+ * @param sg    caller提供的分片数组
+ * @param nr_sg sg数组的容量
+ * 
+ * 返回记录的分片数. 若返回值大于nr_sg, 说明sg不足以容纳所有分片,
+ * 此时记录不会被消费. Return 0 if no readable data.
+ * 
+ * 与 ringbuf_consume() 一样, sg指向的数据在writer重新写到这些page
+ * 之前有效.
+ */
+u32 ringbuf_consume_sg(struct ringbuf *buffer, struct ringbuf_sg *sg,
+        u32 nr_sg)
+{
+    u32 length, n;
+
+    rb_reader_lock(buffer);
+    n = rb_peek_frags(buffer, sg, nr_sg, &length);
+    if (n && n <= nr_sg)
+        rb_advance_reader(buffer);
+    rb_reader_unlock(buffer);
+    return n;
+}
+
+/**
+ * @brief 消费下一条记录, 将其完整数据拷贝到dst
+ * @param size dst的容量
+ * 
+ * 返回记录的数据长度. 若返回值大于size, 记录不会被消费也不会拷贝,
+ * caller可据此分配足够的空间后重试. Return 0 if no readable data.
+ */
+u32 ringbuf_consume_copy(struct ringbuf *buffer, void *dst, u32 size)
+{
+    struct buf_page_meta *bpage;
+    struct ringbuf_item *item;
+    u32 length, n;
+
+    rb_reader_lock(buffer);
+    n = rb_peek_frags(buffer, NULL, 0, &length);
+    if (!n || length > size) {
+        rb_reader_unlock(buffer);
+        return length;
+    }
+
+    item = rb_reader_item(buffer);
+    bpage = buffer->reader_page;
+    for (;;) {
+        memcpy(dst, rb_entry_data(buffer, item), rb_entry_length(buffer, item));
+        dst = (u8 *)dst + rb_entry_length(buffer, item);
+        if (!rb_item_has_next_frag(buffer, item))
+            break;
+        bpage = rb_read_next_page(buffer, bpage);
+        item = rb_page_index(bpage, rb_page_start(buffer));
+    }
+
+    rb_advance_reader(buffer);
+    rb_reader_unlock(buffer);
+    return length;
+}
+
+void *ringbuf_item_data(struct ringbuf_item *item)
+{
+    return rb_item_data(item);
+}
+
+u32 ringbuf_item_data_length(struct ringbuf_item *item)
+{
+    u32 length;
+
+    length = rb_item_data_length(item);
+    rb_debug("ORIGIN lengeth: %d\n", length);
+    return length;
+}
+
+/*
+ * 长度为length的数据写入buffer后实际占用的空间, 包括header和对齐的padding.
+ */
+u32 ringbuf_item_size(struct ringbuf *buffer, u32 length)
+{
+    if (rb_fixed(buffer))
+        return rb_fixed_space(buffer);
+    if (!length)
+        length += 1;
+    return rb_item_space(buffer, length);
+}
+
+/*
+ * 该item是否为大记录的一个分片.
+ * ringbuf_consume() 对这样的记录只返回第一个分片(但会消费整条记录),
+ * 完整数据请使用 ringbuf_consume_sg()/ringbuf_consume_copy() 读取.
+ */
+int ringbuf_item_is_fragment(struct ringbuf_item *item)
+{
+    return item->frag != RB_FRAG_NONE;
+}
+
+
+/* 
+ * write data to the buffer without reserving
+ *
+ * This is like ring_buffer_lock_reserve and ring_buffer_unlock_commit as
+ * one function. If you already have the data to write to the buffer, it
+ * may be easier to simply call this function.
+ * 
+ * Note, like ring_buffer_lock_reserve, the length is the length of the data
+ * and not the length of the event which would hold the header.
+ * 
+ * 超过一个page的数据会被拆分成多个分片写入连续的page.
+ */
+int
+ringbuf_write(struct ringbuf *buffer, u32 length, void *data)
+{
+    return ringbuf_write_type(buffer, 0, length, data);
+}
+
+/**
+ * @brief 同 ringbuf_write(), 并指定记录的type
+ * @param type 0 ~ RB_NR_TYPES-1, 读取时可按type过滤, 参考 ringbuf_consume_filter()
+ */
+int
+ringbuf_write_type(struct ringbuf *buffer, u32 type, u32 length, void *data)
+{
+    struct ringbuf_item *item;
+    void *body;
+
+    assert(type < RB_NR_TYPES);
+    if (rb_fixed(buffer)) {
+        body = ringbuf_reserve_type(buffer, type, length);
+        if (!body)
+            return 1;
+        rb_copy_data(buffer, body, data, length);
+        rb_commit(buffer, NULL);
+        return 0;
+    }
+
+    // RB_FL_MIRROR 的记录不拆分, 最长可以占满整个数据区
+    if (length > RB_ITEM_MAX_DATA(buffer))
+        return rb_mirror(buffer) ? 1 : rb_write_frags(buffer, type, length, data);
+
+    item = rb_reserve_item(buffer, type, length);
+    if (!item)
+        return 1;
+    /* printf("write to item: 0x%p\n", item); */
+    
+    body = rb_entry_data(buffer, item);
+    rb_copy_data(buffer, body, data, length);
+
+    rb_commit(buffer, item);
+
+    return 0;
+}
+
+// RB_FL_TIMESTAMP 未指定时钟时使用, 单位ns
+static u64 rb_default_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * RB_FL_MIRROR: 创建长度为size(按系统page对齐)的memfd, 在一段连续的虚拟
+ * 地址中映射两次, 使 mirror[i] 与 mirror[i + mirror_size] 是同一个字节.
+ */
+static int
+rb_mirror_map(struct ringbuf *buffer, u32 size)
+{
+    long psz = sysconf(_SC_PAGESIZE);
+    u8 *base;
+    int fd;
+
+    size = ALIGN_UP(size ? size : 1, (u32)psz);
+    fd = memfd_create("ringbuf", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size))
+        goto err;
+    // 先保留2倍大小的地址空间, 再把memfd固定映射到前后两半
+    base = mmap(NULL, 2 * (size_t)size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto err;
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                fd, 0) == MAP_FAILED ||
+            mmap(base + size, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * (size_t)size);
+        goto err;
+    }
+    close(fd);
+
+    buffer->mirror = base;
+    buffer->mirror_size = size;
+    buffer->mirror_head = buffer->data_start;
+    buffer->mirror_free = buffer->data_start;
+    buffer->mirror_tail = buffer->data_start;
+    buffer->mirror_commit = buffer->data_start;
+    return 0;
+err:
+    close(fd);
+    return -1;
+}
+
+static void 
+free_buf_page(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    if (bpage->pool) {
+        rb_pool_put(bpage);
+        return;
+    }
+#ifdef RB_ALLOC_DYNAMIC
+    if (buffer->flags & RB_FL_LAZY)
+        munmap(bpage->page, PAGE_SIZE);
+    else
+        free(bpage->page);
+    free(bpage);
+#endif
+}
+
+/**
+ * @brief allocate and init a ringbuffer
+ * 
+ * @param size 
+ * @return struct ringbuf* 
+ */
+struct ringbuf *ringbuf_alloc(u32 size)
+{
+    return ringbuf_alloc_attr(size, NULL);
+}
+
+/**
+ * @brief allocate and init a ringbuffer with attributes
+ * 
+ * @param size 
+ * @param attr 可为NULL, 表示全部使用默认属性
+ * @return struct ringbuf* 
+ */
+struct ringbuf *ringbuf_alloc_attr(u32 size, const struct ringbuf_attr *attr)
+{
+    struct ringbuf *buffer;
+    struct buf_page_meta *bpage;
+    struct buf_page *page;
+    u32 nr_pages;
+    int ret;
+
+    nr_pages = DIV_ROUND_UP(size, BUF_PAGE_SIZE);
+    if (nr_pages < 2)
+        nr_pages = 2;
+
+#ifdef RB_ALLOC_DYNAMIC
+    buffer = rb_zalloc(sizeof(*buffer));
+    if (!buffer)  assert(0);
+#else
+    assert(g_buffer_idx < RB_STATIC_BUFFERS);
+    buffer = &g_buffer[g_buffer_idx++];
+#endif
+
+    if (attr) {
+        buffer->record_size = attr->record_size;
+        buffer->flags = attr->flags;
+        buffer->clock = attr->clock;
+        buffer->max_age = attr->max_age;
+        buffer->sampling = attr->sampling;
+    }
+    assert(!(buffer->flags & RB_FL_SAMPLE) ||
+            (buffer->sampling && buffer->sampling->step));
+    // 按page上最新记录的时间戳判断是否过期
+    assert(!buffer->max_age || (buffer->flags & RB_FL_TIMESTAMP));
+    if ((buffer->flags & (RB_FL_TIMESTAMP | RB_FL_LAZY | RB_FL_LATENCY)) &&
+            !buffer->clock)
+        buffer->clock = rb_default_clock;
+    if (buffer->flags & RB_FL_LATENCY)
+        rb_alloc_latency(buffer);
+    buffer->align = RB_ARCH_ALIGNMENT;
+    if (attr && attr->align)
+        buffer->align = attr->align;
+    assert(!(buffer->align & (buffer->align - 1)));
+    assert(buffer->align >= RB_ARCH_ALIGNMENT &&
+            buffer->align <= RB_CACHELINE_SIZE);
+    if (rb_compact(buffer)) {
+        // 紧凑header按字节排列, 与对齐及固定长度记录互斥
+        assert(!rb_fixed(buffer) && !(attr->align));
+        buffer->align = 1;
+    }
+    if (buffer->flags & RB_FL_ISOLATE)
+        assert(buffer->align == RB_ALIGN_CACHELINE && rb_std_hdr(buffer));
+    buffer->data_start = rb_calc_page_start(buffer);
+    rb_copy_init();
+    if (rb_mirror(buffer)) {
+        // 只支持标准header, 不使用page
+        assert(!(buffer->flags & ~(RB_FL_MIRROR | RB_FL_LATENCY | RB_FL_NT_COPY |
+                        RB_FL_ISOLATE)) &&
+                rb_std_hdr(buffer));
+        assert(!attr->pool);
+        if (rb_mirror_map(buffer, size))
+            assert(0);
+        return buffer;
+    }
+    if (buffer->flags & RB_FL_CRC)
+        rb_crc32c_init();
+    if (rb_fixed(buffer))
+        assert(rb_fixed_space(buffer) <= BUF_PAGE_SIZE - buffer->data_start);
+    if (attr && attr->history)
+        rb_alloc_history(buffer, attr->history);
+
+    buffer->min_page = nr_pages;
+    buffer->max_page = nr_pages;
+    if (attr && attr->pool) {
+        buffer->pool = attr->pool;
+        buffer->max_page += attr->pool->nr_page;
+        if (attr->max_size > nr_pages * BUF_PAGE_SIZE)
+            buffer->max_page = MIN(buffer->max_page,
+                    DIV_ROUND_UP(attr->max_size, BUF_PAGE_SIZE));
+        else if (attr->max_size)
+            buffer->max_page = nr_pages;
+    }
+
+    // allocate reader page alone
+#ifdef RB_ALLOC_DYNAMIC
+    bpage = rb_zalloc(sizeof(*bpage));
+    if (!bpage)  assert(0);
+    page = rb_alloc_page(buffer);
+    if (!page) assert(0);
+#else
+    assert(g_page_idx < RB_STATIC_PAGES);
+    bpage = &g_bpage[g_page_idx];
+    page = (struct buf_page *)&g_page[g_page_idx];
+    g_page_idx ++;
+#endif
+
+    bpage->page = page;
+    bpage->index = (u32)-1;
+    buffer->reader_page = bpage;
+    rb_reset_page(buffer, bpage);
+    rb_page_populate(buffer, bpage);
+
+    INIT_LIST_HEAD(&buffer->reader_page->list);
+
+    // allocate other pages
+    ret = rb_allocate_pages(buffer, nr_pages);
+    if (ret < 0)
+        assert(0);
+
+    buffer->tail_page = buffer->head_page;
+    rb_page_populate(buffer, buffer->tail_page);
+    
+    rb_head_page_activate(buffer);
+    
+    return buffer;
+}
+
+static int
+rb_write_full(int fd, const void *data, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, data, len);
+        if (n < 0)
+            return -1;
+        data = (const u8 *)data + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 按buffer的记录格式填写文件头, page相关的成员由caller填写
+static void
+rb_file_hdr(struct ringbuf *buffer, struct ringbuf_file_hdr *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, RB_FILE_MAGIC, sizeof(hdr->magic));
+    hdr->version = RB_FILE_VERSION;
+    hdr->byte_order = RB_FILE_BYTE_ORDER;
+    hdr->page_size = PAGE_SIZE;
+    hdr->page_hdr_size = BUF_PAGE_HDR_SIZE;
+    hdr->align = buffer->align;
+    hdr->data_start = buffer->data_start;
+    hdr->record_size = buffer->record_size;
+    hdr->flags = buffer->flags & (RB_FL_COMPACT | RB_FL_TIMESTAMP | RB_FL_CRC |
+            RB_FL_ISOLATE);
+    if (buffer->flags & RB_FL_TIMESTAMP)
+        hdr->clock = buffer->clock == rb_default_clock ?
+            RB_CLOCK_MONOTONIC : RB_CLOCK_CUSTOM;
+    hdr->first_offset = rb_page_start(buffer);
+    hdr->first_seq = buffer->nr_read;
+}
+
+// 文件头补齐到一个page
+static int
+rb_write_file_hdr(int fd, const struct ringbuf_file_hdr *hdr)
+{
+    static const u8 zero[PAGE_SIZE];
+
+    if (rb_write_full(fd, hdr, sizeof(*hdr)) ||
+            rb_write_full(fd, zero, PAGE_SIZE - sizeof(*hdr)))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief 将buffer中未消费的记录写入文件, 格式参考 struct ringbuf_file_hdr
+ * @param fd 以写方式打开的文件
+ * 
+ * page原样写入, 不重新编码记录, 也不消费记录. 不能与writer并发,
+ * writer运行时可以先 ringbuf_snapshot() 再保存snapshot.
+ * 
+ * Return 0 on success, -1 on write error.
+ */
+int ringbuf_save(struct ringbuf *buffer, int fd)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+    struct ringbuf_file_hdr hdr;
+    u32 nr_ring;
+    int has_reader;
+
+    assert(!rb_mirror(buffer));
+    nr_ring = rb_nr_ring_pages(buffer);
+    has_reader = reader->read < rb_page_size(reader);
+
+    rb_page_seal(buffer, buffer->tail_page);
+    rb_file_hdr(buffer, &hdr);
+    hdr.nr_page = nr_ring + has_reader;
+    if (has_reader)
+        hdr.first_offset = reader->read;
+    hdr.nr_entry = rb_num_of_entry(buffer);
+
+    if (rb_write_file_hdr(fd, &hdr))
+        return -1;
+    if (has_reader && rb_write_full(fd, reader->page, PAGE_SIZE))
+        return -1;
+    for (u32 k = 0; k < nr_ring; k++) {
+        if (rb_write_full(fd, rb_ring_page(buffer, k)->page, PAGE_SIZE))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+rb_pwrite_full(int fd, const void *data, size_t len, u64 offset)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pwrite(fd, data, len, offset);
+        if (n < 0)
+            return -1;
+        data = (const u8 *)data + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// 同步写入reader_page中未读的记录, 并将其标记为已读
+static int
+rb_flush_reader(struct ringbuf_flusher *flusher)
+{
+    struct ringbuf *buffer = flusher->buffer;
+    struct buf_page_meta *reader = buffer->reader_page;
+
+    if (!flusher->hdr.nr_page)
+        flusher->hdr.first_offset = reader->read;
+    if (reader == buffer->tail_page)
+        rb_page_seal(buffer, reader);
+    if (rb_pwrite_full(flusher->fd, reader->page, PAGE_SIZE, flusher->offset))
+        return -1;
+    flusher->offset += PAGE_SIZE;
+    flusher->hdr.nr_page += 1;
+
+    reader->read = rb_page_size(reader);
+    buffer->nr_read = reader->seq + reader->nr_entry;
+    return 0;
+}
+
+// flusher->spare 全部正在写入时的busy
+#define RB_FLUSH_ALL ((u32)((1ull << RB_FLUSH_BATCH) - 1))
+
+#ifdef RB_IO_URING
+/*
+ * 为taken中的每个spare提交一个写入, 不等待完成. 写入中的spare记在busy中,
+ * 由 rb_flush_reap() 逐个回收, 不必等整批写完.
+ */
+static int
+rb_flush_pages(struct ringbuf_flusher *flusher, u32 taken)
+{
+    struct io_uring *ring = flusher->uring;
+    struct io_uring_sqe *sqe;
+
+    for (u32 i = 0; i < RB_FLUSH_BATCH; i++) {
+        if (!(taken & 1u << i))
+            continue;
+        sqe = io_uring_get_sqe(ring);
+        io_uring_prep_write(sqe, flusher->fd, flusher->spare[i]->page, PAGE_SIZE,
+                flusher->offset);
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+        flusher->busy_off[i] = flusher->offset;
+        flusher->offset += PAGE_SIZE;
+    }
+    // 提交失败时这些写入不会完成, 不能等待它们
+    if (io_uring_submit(ring) < 0)
+        return -1;
+    flusher->busy |= taken;
+    return 0;
+}
+
+/*
+ * 回收已完成的写入, 对应的spare立即可以换出下一个满page.
+ * wait非0时至少等待一个写入完成. 返回回收的个数.
+ */
+static u32
+rb_flush_reap(struct ringbuf_flusher *flusher, int wait)
+{
+    struct io_uring *ring = flusher->uring;
+    struct io_uring_cqe *cqe;
+    u32 i, n = 0;
+
+    while (flusher->busy) {
+        if (wait && !n) {
+            if (io_uring_wait_cqe(ring, &cqe)) {
+                flusher->error = 1;
+                break;
+            }
+        } else if (io_uring_peek_cqe(ring, &cqe)) {
+            break;
+        }
+        i = (u32)(uintptr_t)io_uring_cqe_get_data(cqe);
+        // 短写时同步补齐
+        if (cqe->res < 0)
+            flusher->error = 1;
+        else if ((u32)cqe->res < PAGE_SIZE &&
+                rb_pwrite_full(flusher->fd, (u8 *)flusher->spare[i]->page + cqe->res,
+                    PAGE_SIZE - cqe->res, flusher->busy_off[i] + cqe->res))
+            flusher->error = 1;
+        io_uring_cqe_seen(ring, cqe);
+        flusher->busy &= ~(1u << i);
+        n++;
+    }
+    return n;
+}
+#else
+// 用一次pwritev()写入taken中的全部spare
+static int
+rb_flush_pages(struct ringbuf_flusher *flusher, u32 taken)
+{
+    struct iovec iov[RB_FLUSH_BATCH];
+    struct buf_page_meta *pages[RB_FLUSH_BATCH];
+    ssize_t done;
+    u32 nr = 0;
+    u64 off;
+
+    for (u32 i = 0; i < RB_FLUSH_BATCH; i++) {
+        if (!(taken & 1u << i))
+            continue;
+        pages[nr] = flusher->spare[i];
+        iov[nr].iov_base = pages[nr]->page;
+        iov[nr].iov_len = PAGE_SIZE;
+        nr++;
+    }
+    done = pwritev(flusher->fd, iov, nr, flusher->offset);
+    if (done < 0)
+        return -1;
+
+    // 短写时逐page补齐
+    for (u32 i = 0; i < nr; i++) {
+        off = (u64)i * PAGE_SIZE;
+        if ((u64)done >= off + PAGE_SIZE)
+            continue;
+        off = (u64)done > off ? (u64)done - off : 0;
+        if (rb_pwrite_full(flusher->fd, (u8 *)pages[i]->page + off,
+                    PAGE_SIZE - off, flusher->offset + (u64)i * PAGE_SIZE + off))
+            return -1;
+    }
+    flusher->offset += (u64)nr * PAGE_SIZE;
+    return 0;
+}
+
+// 同步写入没有未完成的写入
+static u32
+rb_flush_reap(struct ringbuf_flusher *flusher, int wait)
+{
+    return 0;
+}
+#endif
+
+/*
+ * flush线程: 持有buffer的锁把写满的page与空闲的spare交换, 释放锁后写入,
+ * 写完的page成为新的spare. writer只在交换指针期间被阻塞.
+ * RB_IO_URING 时每个page写完即可再次使用, 不等同批的其他page.
+ */
+static void *
+rb_flush_thread(void *arg)
+{
+    struct ringbuf_flusher *flusher = arg;
+    struct ringbuf *buffer = flusher->buffer;
+    struct buf_page_meta *reader = buffer->reader_page;
+    int has_reader;
+    u32 taken;
+
+    while (!flusher->error) {
+        rb_lock(buffer);
+        // 启动时reader_page中可能还有未读的记录, writer离开后先写入它
+        has_reader = reader->read < rb_page_size(reader) &&
+            reader != buffer->tail_page && rb_page_committed(buffer, reader);
+        taken = 0;
+        for (u32 i = 0; !has_reader && i < RB_FLUSH_BATCH; i++) {
+            if (flusher->busy & 1u << i)
+                continue;
+            if (!rb_head_page_full(buffer))
+                break;
+            flusher->spare[i] = rb_take_head_page(buffer, flusher->spare[i]);
+            taken |= 1u << i;
+        }
+        rb_unlock(buffer);
+
+        if (has_reader) {
+            if (rb_flush_reader(flusher))
+                flusher->error = 1;
+            continue;
+        }
+        if (taken) {
+            if (!flusher->hdr.nr_page)
+                flusher->hdr.first_offset = rb_page_start(buffer);
+            if (rb_flush_pages(flusher, taken))
+                flusher->error = 1;
+            flusher->hdr.nr_page += __builtin_popcount(taken);
+            continue;
+        }
+        // 所有spare都在写入时等待其中一个完成, 否则只回收已完成的
+        if (rb_flush_reap(flusher, flusher->busy == RB_FLUSH_ALL))
+            continue;
+        if (__atomic_load_n(&flusher->stop, __ATOMIC_ACQUIRE) && !flusher->busy)
+            break;
+        usleep(RB_FLUSH_INTERVAL_US);
+    }
+    // 出错退出时也要等提交的写入完成, 之后spare才能释放
+    while (flusher->busy && rb_flush_reap(flusher, 1))
+        ;
+    return NULL;
+}
+
+/**
+ * @brief 启动后台flush线程, 把buffer中的记录持续写入文件
+ * @param flusher caller提供的存储, 在 ringbuf_flush_stop() 之前保持有效
+ * @param fd      以写方式打开的文件, 写入的格式与 ringbuf_save() 相同
+ * 
+ * 写满的page被换出环后在flush线程中批量写入(RB_IO_URING 时使用io_uring,
+ * 每个page写完即可重新使用; 否则为一次pwritev), 写完后作为空page换回环中,
+ * 应用只需调用 ringbuf_write().
+ * flush线程是buffer唯一的reader, 运行期间应用不能读取buffer.
+ * 需要在writer开始并发写入之前调用.
+ * 
+ * Return 0 on success, -1 on error.
+ */
+int ringbuf_flush_start(struct ringbuf_flusher *flusher, struct ringbuf *buffer,
+        int fd)
+{
+    struct list_head pages;
+    struct buf_page_meta *bpage, *tmp;
+    u32 i = 0;
+
+    assert(!rb_mirror(buffer));
+    memset(flusher, 0, sizeof(*flusher));
+    flusher->buffer = buffer;
+    flusher->fd = fd;
+    rb_file_hdr(buffer, &flusher->hdr);
+    if (rb_write_file_hdr(fd, &flusher->hdr))
+        return -1;
+    flusher->offset = PAGE_SIZE;
+
+#ifdef RB_IO_URING
+    flusher->uring = malloc(sizeof(struct io_uring));
+    if (!flusher->uring)
+        return -1;
+    if (io_uring_queue_init(RB_FLUSH_BATCH, flusher->uring, 0)) {
+        free(flusher->uring);
+        return -1;
+    }
+#endif
+
+    INIT_LIST_HEAD(&pages);
+    __rb_allocate_pages(buffer, RB_FLUSH_BATCH, &pages);
+    list_for_each_entry_safe(bpage, tmp, &pages, list) {
+        list_del_init(&bpage->list);
+        flusher->spare[i++] = bpage;
+    }
+
+    buffer->flags |= RB_FL_FLUSH;
+    if (pthread_create(&flusher->thread, NULL, rb_flush_thread, flusher)) {
+        buffer->flags &= ~RB_FL_FLUSH;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 停止flush线程, 写入剩余的全部记录(包括未写满的page)并更新文件头
+ * 
+ * 调用前writer应已停止写入. Return 0 on success, -1 if any write failed.
+ */
+int ringbuf_flush_stop(struct ringbuf_flusher *flusher)
+{
+    struct ringbuf *buffer = flusher->buffer;
+
+    __atomic_store_n(&flusher->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher->thread, NULL);
+    buffer->flags &= ~RB_FL_FLUSH;
+
+    // 剩下的page都未写满, 按reader的方式逐个换入并写入
+    while (!flusher->error && rb_get_reader_page(buffer)) {
+        if (rb_flush_reader(flusher))
+            flusher->error = 1;
+    }
+
+    flusher->hdr.nr_entry = buffer->nr_read - flusher->hdr.first_seq;
+    if (rb_pwrite_full(flusher->fd, &flusher->hdr, sizeof(flusher->hdr), 0))
+        flusher->error = 1;
+
+    for (u32 i = 0; i < RB_FLUSH_BATCH; i++)
+        free_buf_page(buffer, flusher->spare[i]);
+#ifdef RB_IO_URING
+    io_uring_queue_exit(flusher->uring);
+    free(flusher->uring);
+#endif
+    return flusher->error ? -1 : 0;
+}
+
+// 校验当前page, RB_FL_CRC 校验失败的page整页跳过. page header损坏时返回-1
+static int
+rb_file_check_page(struct ringbuf_file *file)
+{
+    struct buf_page_meta *bpage = &file->meta;
+    u32 commit = rb_page_size(bpage);
+
+    if ((file->fmt.flags & RB_FL_CRC) &&
+            bpage->page->crc != rb_page_crc(bpage->page)) {
+        file->nr_crc_err += 1;
+        bpage->read = commit;
+        return 0;
+    }
+    // 没有CRC时只能检查commit是否在page之内
+    if (commit < rb_page_start(&file->fmt) || commit > BUF_PAGE_SIZE)
+        return -1;
+    return 0;
+}
+
+/*
+ * file->meta.read 处的item(含header)是否完整地位于page的commit之内.
+ * 文件可能被截断或损坏, 解析header之前先确认不会越界.
+ */
+static int
+rb_file_item_ok(struct ringbuf_file *file)
+{
+    struct ringbuf *fmt = &file->fmt;
+    struct buf_page_meta *bpage = &file->meta;
+    u32 avail = rb_page_size(bpage) - bpage->read;
+    const u8 *p = rb_page_index(bpage, bpage->read);
+    u32 n = 1;
+
+    if (rb_compact(fmt)) {
+        if (!avail)
+            return 0;
+        if (!(p[0] >> 5)) {
+            while (n < avail && n <= 5 && (p[n] & 0x80))
+                n++;
+            // varint最多5字节, 且在commit之内结束
+            if (n >= avail || n > 5)
+                return 0;
+        }
+    } else if (!rb_fixed(fmt) && avail < rb_item_hdr_size(fmt)) {
+        return 0;
+    }
+    return rb_item_length(fmt, (struct ringbuf_item *)p) <= avail;
+}
+
+// 文件头描述的记录格式是否能被本程序解析
+static int
+rb_file_hdr_ok(const struct ringbuf_file_hdr *hdr, u64 size)
+{
+    return !memcmp(hdr->magic, RB_FILE_MAGIC, sizeof(hdr->magic)) &&
+        hdr->version == RB_FILE_VERSION &&
+        hdr->byte_order == RB_FILE_BYTE_ORDER &&
+        hdr->page_size == PAGE_SIZE &&
+        hdr->page_hdr_size == BUF_PAGE_HDR_SIZE &&
+        (u64)hdr->nr_page + 1 <= size / PAGE_SIZE &&
+        !(hdr->flags & ~(RB_FL_COMPACT | RB_FL_TIMESTAMP | RB_FL_CRC |
+                RB_FL_ISOLATE)) &&
+        hdr->align && !(hdr->align & (hdr->align - 1)) &&
+        hdr->align <= RB_CACHELINE_SIZE &&
+        (!(hdr->flags & RB_FL_ISOLATE) || hdr->align == RB_CACHELINE_SIZE) &&
+        hdr->data_start < BUF_PAGE_SIZE &&
+        hdr->record_size <= BUF_PAGE_SIZE - hdr->data_start &&
+        !(hdr->record_size && (hdr->flags & RB_FL_COMPACT)) &&
+        hdr->first_offset <= BUF_PAGE_SIZE;
+}
+
+/**
+ * @brief mmap打开 ringbuf_save() 写入的文件
+ * 
+ * Return 0 on success, -1 if the file can not be mapped, its format
+ * is not supported by this build or its header is corrupted.
+ */
+int ringbuf_file_open(struct ringbuf_file *file, const char *path)
+{
+    const struct ringbuf_file_hdr *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(file, 0, sizeof(*file));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || st.st_size < PAGE_SIZE) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = map;
+    file->hdr = hdr;
+    file->size = st.st_size;
+    if (!rb_file_hdr_ok(hdr, file->size)) {
+        ringbuf_file_close(file);
+        return -1;
+    }
+
+    file->fmt.align = hdr->align;
+    file->fmt.data_start = hdr->data_start;
+    file->fmt.record_size = hdr->record_size;
+    file->fmt.flags = hdr->flags;
+    if (hdr->flags & RB_FL_CRC)
+        rb_crc32c_init();
+    file->page = 0;
+    file->seq = hdr->first_seq;
+    file->meta.page = (struct buf_page *)((u8 *)map + PAGE_SIZE);
+    file->meta.read = hdr->first_offset;
+    if (hdr->nr_page && rb_file_check_page(file)) {
+        ringbuf_file_close(file);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 顺序读取文件中的下一条记录, entry 同 ringbuf_consume_entry()
+ * 
+ * entry指向mmap的文件内容, 在 ringbuf_file_close() 之前有效.
+ * 没有 RB_FL_CRC 的文件中损坏的page无法跳过, 读到时返回-1.
+ * Return 1 on success, 0 if no more records, -1 if the file is corrupted.
+ */
+int ringbuf_file_next(struct ringbuf_file *file, struct ringbuf_entry *entry)
+{
+    const struct ringbuf_file_hdr *hdr = file->hdr;
+    struct buf_page_meta *bpage = &file->meta;
+    struct ringbuf_item *item;
+
+    if (!hdr->nr_page || file->seq >= hdr->first_seq + hdr->nr_entry)
+        return 0;
+
+    for (;;) {
+        if (bpage->read >= rb_page_size(bpage)) {
+            if (++file->page >= hdr->nr_page)
+                return 0;
+            bpage->page = (struct buf_page *)((u8 *)bpage->page + PAGE_SIZE);
+            bpage->read = rb_page_start(&file->fmt);
+            if (rb_file_check_page(file))
+                return -1;
+            continue;
+        }
+        if (!rb_file_item_ok(file))
+            return -1;
+        item = rb_page_index(bpage, bpage->read);
+        bpage->read += rb_item_length(&file->fmt, item);
+        // 后续分片已随第一个分片返回
+        if (!rb_item_is_cont(&file->fmt, item))
+            break;
+    }
+
+    rb_item_to_entry(&file->fmt, bpage, item, entry);
+    entry->seq = file->seq++;
+    return 1;
+}
+
+void ringbuf_file_close(struct ringbuf_file *file)
+{
+    if (file->hdr)
+        munmap((void *)file->hdr, file->size);
+    file->hdr = NULL;
+}
+
+/**
+ * @brief 创建一个可供多个buffer共享的page池
+ * @param pool     caller提供的存储, 在使用它的buffer都释放之前保持有效
+ * @param nr_pages 池中的page数, 即所有buffer借用page的总上限
+ * 
+ * 通过 ringbuf_attr.pool 使用pool的buffer写满自有的page后从pool借用空page
+ * 插入环中, reader读完借来的page后立即归还, 总的内存占用随负载伸缩.
+ * 借用和归还都是lock-free的, 多个buffer的writer/reader可以并发使用同一个pool.
+ * 
+ * Return 0 on success, -1 on error.
+ */
+int ringbuf_pool_init(struct ringbuf_pool *pool, u32 nr_pages)
+{
+    struct buf_page_meta *bpage;
+    u8 *mem;
+
+    memset(pool, 0, sizeof(*pool));
+#ifdef RB_ALLOC_DYNAMIC
+    pool->pages = rb_zalloc((size_t)nr_pages * sizeof(*pool->pages));
+    mem = aligned_alloc(PAGE_SIZE, (size_t)nr_pages * PAGE_SIZE);
+    if (!pool->pages || !mem) {
+        free(pool->pages);
+        free(mem);
+        return -1;
+    }
+#else
+    if (g_page_idx + nr_pages > RB_STATIC_PAGES)
+        return -1;
+    pool->pages = &g_bpage[g_page_idx];
+    mem = (u8 *)&g_page[g_page_idx];
+    g_page_idx += nr_pages;
+#endif
+
+    pool->nr_page = nr_pages;
+    for (u32 i = 0; i < nr_pages; i++) {
+        bpage = &pool->pages[i];
+        bpage->page = (struct buf_page *)(mem + (size_t)i * PAGE_SIZE);
+        bpage->pool = pool;
+        rb_pool_put(bpage);
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放pool的内存, 调用前使用它的buffer都应已释放
+ */
+void ringbuf_pool_destroy(struct ringbuf_pool *pool)
+{
+    assert(pool->nr_free == pool->nr_page);
+#ifdef RB_ALLOC_DYNAMIC
+    if (pool->nr_page)
+        free(pool->pages[0].page);
+    free(pool->pages);
+#endif
+    pool->pages = NULL;
+}
+
+/**
+ * @brief 创建由nr个lane组成的buffer, 参考 struct ringbuf_lanes
+ * @param attrs 各lane的属性, attrs[0]优先级最高
+ * @param shared 各lane共享的空间, lane写满自有的page后从中借用, 可以为0
+ * @param drain 读取时选择lane的方式, RB_DRAIN_*
+ * 
+ * 每个lane都是一个独立的ringbuf(lanes->lanes[i]), 除本文件的接口外也可以
+ * 直接使用ringbuf的其他接口读写. 共享空间通过 ringbuf_pool_init() 分配.
+ * 
+ * ringbuf_lanes_write() 和 ringbuf_lanes_consume() 访问每个lane时都持有
+ * 该lane的自旋锁, writer与reader可以在不同的线程中: RB_LANE_DROP_OLD 的
+ * writer会在锁内消费最旧的记录, 不会与reader同时修改reader的状态. 直接
+ * 使用 lanes->lanes[i] 时由caller负责互斥.
+ * RB_LANE_DROP_OLD 的lane被writer消费后, reader持有的记录所在的page可能被
+ * 重新写入, 因此这种lane返回的记录应在下一次写入该lane之前拷贝.
+ * 
+ * Return 0 on success, -1 on error.
+ */
+int ringbuf_lanes_init(struct ringbuf_lanes *lanes, const struct ringbuf_lane_attr *attrs,
+        u32 nr, u32 shared, u32 drain)
+{
+    struct ringbuf_attr attr;
+
+    assert(nr > 0 && nr <= RB_LANES_MAX);
+    assert(drain == RB_DRAIN_PRIORITY || drain == RB_DRAIN_WEIGHTED);
+    memset(lanes, 0, sizeof(*lanes));
+    if (shared && ringbuf_pool_init(&lanes->pool,
+                DIV_ROUND_UP(shared, BUF_PAGE_SIZE)))
+        return -1;
+
+    for (u32 i = 0; i < nr; i++) {
+        assert(attrs[i].policy == RB_LANE_DROP_NEW ||
+                attrs[i].policy == RB_LANE_DROP_OLD);
+        attr = attrs[i].attr;
+        attr.pool = shared ? &lanes->pool : NULL;
+        lanes->lanes[i] = ringbuf_alloc_attr(attrs[i].size, &attr);
+        lanes->policy[i] = attrs[i].policy;
+        lanes->weight[i] = attrs[i].weight ? attrs[i].weight : 1;
+    }
+    lanes->nr_lane = nr;
+    lanes->drain = drain;
+    lanes->credit = lanes->weight[0];
+    return 0;
+}
+
+void ringbuf_lanes_destroy(struct ringbuf_lanes *lanes)
+{
+    for (u32 i = 0; i < lanes->nr_lane; i++)
+        ringbuf_free(lanes->lanes[i]);
+    ringbuf_pool_destroy(&lanes->pool);
+    lanes->nr_lane = 0;
+}
+
+/**
+ * @brief 向第lane个lane写入一条记录, 同 ringbuf_write()
+ * 
+ * lane写满时按其policy处理: RB_LANE_DROP_NEW 返回非0;
+ * RB_LANE_DROP_OLD 依次丢弃最旧的记录直到能够写入, 记录比lane本身
+ * 还大时返回非0. 丢弃的记录都计入 lanes->nr_dropped[lane].
+ */
+static inline void
+rb_lane_lock(struct ringbuf_lanes *lanes, u32 lane)
+{
+    while (__atomic_test_and_set(&lanes->lock[lane], __ATOMIC_ACQUIRE))
+        ;
+}
+
+static inline void
+rb_lane_unlock(struct ringbuf_lanes *lanes, u32 lane)
+{
+    __atomic_clear(&lanes->lock[lane], __ATOMIC_RELEASE);
+}
+
+int ringbuf_lanes_write(struct ringbuf_lanes *lanes, u32 lane, u32 length, void *data)
+{
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    int ret = 0;
+
+    assert(lane < lanes->nr_lane);
+    buffer = lanes->lanes[lane];
+    rb_lane_lock(lanes, lane);
+    while (ringbuf_write(buffer, length, data)) {
+        lanes->nr_dropped[lane] += 1;
+        if (lanes->policy[lane] == RB_LANE_DROP_OLD &&
+                ringbuf_consume_entry(buffer, &entry))
+            continue;
+        ret = 1;
+        break;
+    }
+    rb_lane_unlock(lanes, lane);
+    return ret;
+}
+
+// 在lane的锁内消费其中的下一条记录
+static int
+rb_lane_consume(struct ringbuf_lanes *lanes, u32 lane, struct ringbuf_entry *entry)
+{
+    int ret;
+
+    rb_lane_lock(lanes, lane);
+    ret = ringbuf_consume_entry(lanes->lanes[lane], entry);
+    rb_lane_unlock(lanes, lane);
+    return ret;
+}
+
+/**
+ * @brief 按 lanes->drain 选择一个lane, 消费其中的下一条记录
+ * @param lane 可为NULL, 返回记录所在的lane
+ * 
+ * RB_DRAIN_PRIORITY 下只要高优先级的lane有数据就不会读取低优先级的lane.
+ * RB_DRAIN_WEIGHTED 下一条记录到达lane的头部后, 最多再读取其他lane的
+ * weight之和条记录就会被读到, 而与其他lane中积压了多少记录无关.
+ * 同 ringbuf_consume_entry(), 返回的记录在下一次读取该lane前保持有效,
+ * RB_LANE_DROP_OLD 的lane还受写入的限制, 见 ringbuf_lanes_init().
+ * 
+ * Return 0 if all lanes are empty.
+ */
+int ringbuf_lanes_consume(struct ringbuf_lanes *lanes, struct ringbuf_entry *entry,
+        u32 *lane)
+{
+    u32 i;
+
+    if (lanes->drain == RB_DRAIN_PRIORITY) {
+        for (i = 0; i < lanes->nr_lane; i++) {
+            if (rb_lane_consume(lanes, i, entry))
+                goto found;
+        }
+        return 0;
+    }
+
+    // 当前lane用完本轮的credit或者没有数据时轮到下一个lane,
+    // 最多转一整圈回到当前lane
+    for (u32 n = 0; n <= lanes->nr_lane; n++) {
+        i = lanes->cur;
+        if (lanes->credit && rb_lane_consume(lanes, i, entry)) {
+            lanes->credit -= 1;
+            goto found;
+        }
+        lanes->cur = (i + 1) % lanes->nr_lane;
+        lanes->credit = lanes->weight[lanes->cur];
+    }
+    return 0;
+
+found:
+    if (lane)
+        *lane = i;
+    return 1;
+}
+
+/**
+ * @brief 分配一个与buffer大小、属性都相同的空buffer, 用作 ringbuf_snapshot() 的spare
+ */
+struct ringbuf *ringbuf_alloc_snapshot(struct ringbuf *buffer)
+{
+    struct ringbuf_attr attr = {
+        .align = rb_compact(buffer) ? 0 : buffer->align,
+        .record_size = buffer->record_size,
+        .flags = buffer->flags & ~RB_FL_TRIGGER,
+        .clock = buffer->clock,
+        .pool = buffer->pool,
+        .max_size = buffer->max_page * BUF_PAGE_SIZE,
+        .sampling = buffer->sampling,
+        .history = buffer->hist_size,
+    };
+
+    return ringbuf_alloc_attr(buffer->min_page * BUF_PAGE_SIZE, &attr);
+}
+
+/**
+ * @brief 冻结buffer当前的内容, writer可以继续写入
+ * @param spare 由 ringbuf_alloc_snapshot() 分配, 或上一次snapshot返回的buffer.
+ *              其中尚未读取的数据会被丢弃.
+ * 
+ * 类似 Linux trace 的 max-latency snapshot: 交换buffer与spare的page环,
+ * 不拷贝任何page. 交换后buffer从spare的空page继续写入, 记录的序号连续;
+ * spare持有原来的全部记录, 可以用 ringbuf_iter_start()/ringbuf_consume_entry()
+ * 等接口读取, 但不应再写入.
+ * 
+ * writer只在交换指针期间被阻塞(需要 RB_FL_SNAPSHOT). 消费记录的接口
+ * (ringbuf_consume_entry() 等)在buffer的锁内访问reader状态, 可以与snapshot
+ * 并发; 迭代器和 ringbuf_merge_next() 跨调用持有reader page, 不能与
+ * snapshot并发.
+ * 
+ * @return spare
+ */
+struct ringbuf *ringbuf_snapshot(struct ringbuf *buffer, struct ringbuf *spare)
+{
+    assert(rb_spare_compatible(buffer, spare));
+
+    rb_reset_ring(spare);
+
+    rb_lock(buffer);
+    rb_swap_ring(buffer, spare);
+    rb_unlock(buffer);
+    return spare;
+}
+
+/**
+ * @brief 设置commit时检查的触发条件, 参考 struct ringbuf_trigger
+ * @param trig 为NULL时取消触发条件, 已停止的buffer恢复写入.
+ *             trig在取消前必须保持有效.
+ * 
+ * 不能与writer并发调用. RB_TRIG_SNAPSHOT 的spare在此时清空, 触发时
+ * writer在commit中交换page环的指针, 因此要求buffer带有 RB_FL_SNAPSHOT:
+ * 消费记录的接口与writer互斥, 不会看到交换到一半的reader_page/head_page.
+ * 迭代器和 ringbuf_merge_next() 不受保护, 触发条件设置期间不能使用.
+ */
+void ringbuf_set_trigger(struct ringbuf *buffer, const struct ringbuf_trigger *trig)
+{
+    buffer->trigger = trig;
+    if (!trig) {
+        buffer->flags &= ~RB_FL_TRIGGER;
+        buffer->trig_state = RB_TRIG_NONE;
+        return;
+    }
+
+    assert(trig->type < RB_NR_TYPES);
+    assert(trig->size == 1 || trig->size == 2 || trig->size == 4 ||
+            trig->size == 8);
+    if (trig->action == RB_TRIG_SNAPSHOT) {
+        assert(buffer->flags & RB_FL_SNAPSHOT);
+        assert(trig->spare && rb_spare_compatible(buffer, trig->spare));
+        rb_reset_ring(trig->spare);
+    }
+    buffer->trig_state = RB_TRIG_ARMED;
+    buffer->flags |= RB_FL_TRIGGER;
+}
+
+/**
+ * @brief 触发条件是否已经满足并执行了action
+ */
+int ringbuf_trigger_fired(struct ringbuf *buffer)
+{
+    return buffer->trig_state == RB_TRIG_FIRED;
+}
+
+/**
+ * @brief free the ringbuffer
+ * 
+ * @param buffer 
+ */
+void ringbuf_free(struct ringbuf *buffer)
+{
+    struct list_head *head;
+    struct buf_page_meta *bpage, *tmp;
+
+    if (rb_mirror(buffer)) {
+        munmap(buffer->mirror, 2 * (size_t)buffer->mirror_size);
+#ifdef RB_ALLOC_DYNAMIC
+        free(buffer->lat);
+        free(buffer->lat_stamp);
+        free(buffer);
+#endif
+        return;
+    }
+
+    // clear flag 才可以使用list_for_each
+    // buffer->pages 可能已经作为 reader_page 被换出, 从 head_page 开始遍历
+    rb_head_page_deactivate(buffer);
+    head = &buffer->head_page->list;
+    list_for_each_entry_safe(bpage, tmp, head, list) {
+        list_del_init(&bpage->list);
+        free_buf_page(buffer, bpage);
+    }
+    free_buf_page(buffer, buffer->head_page);
+    free_buf_page(buffer, buffer->reader_page);
+#ifdef RB_ALLOC_DYNAMIC
+    free(buffer->page_index);
+    if (buffer->hist) {
+        free(buffer->hist);
+        free(buffer->hist_scratch);
+        free(buffer->hist_page->page);
+        free(buffer->hist_page);
+    }
+    free(buffer->lat);
+    free(buffer->lat_stamp);
+    free(buffer);
+#endif
+}
+
+/**
+ * @brief 立即跳过已超出 ringbuf_attr.max_age 的page, 返回跳过的记录数
+ * 
+ * reader读取时会自动跳过过期的page, 长时间没有读取的buffer可以由reader
+ * 定期调用, 使过期的page尽早归还pool(或在 RB_FL_LAZY 下被释放).
+ * 只能在reader的上下文中调用.
+ */
+u64 ringbuf_expire(struct ringbuf *buffer)
+{
+    u64 nr = buffer->nr_expired;
+
+    assert(buffer->max_age);
+    rb_reader_lock(buffer);
+    rb_expire_refresh(buffer);
+    rb_get_reader_page(buffer);
+    rb_reader_unlock(buffer);
+    return buffer->nr_expired - nr;
+}
+
+/**
+ * @brief RB_FL_LAZY: 立即释放读完后空闲超过 RB_LAZY_IDLE_NS 的page的物理内存
+ * 
+ * reader换入page时会定期自动检查, 长时间没有读取的buffer可以由应用
+ * 定期调用. 返回释放的page数.
+ */
+u32 ringbuf_release_idle(struct ringbuf *buffer)
+{
+    u32 nr;
+
+    assert(buffer->flags & RB_FL_LAZY);
+    rb_lock(buffer);
+    nr = rb_lazy_release(buffer, buffer->clock());
+    rb_unlock(buffer);
+    return nr;
+}
+
+/**
+ * @brief RB_FL_LATENCY: 读取commit到consume的延迟直方图
+ * @param hist 可为NULL, 此时只清零
+ * @param reset 非0时读取的同时清零
+ * 
+ * 不需要与reader同步: 逐个原子地读取(或交换为0)直方图的各成员,
+ * 清零时不会丢失reader同时计入的记录, 但各成员之间可能不完全一致.
+ */
+void ringbuf_latency_read(struct ringbuf *buffer, struct ringbuf_latency *hist, int reset)
+{
+    u64 *src = (u64 *)buffer->lat;
+
+    assert(buffer->flags & RB_FL_LATENCY);
+    for (u32 i = 0; i < sizeof(*hist) / sizeof(u64); i++) {
+        u64 v = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED) :
+            __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        if (hist)
+            ((u64 *)hist)[i] = v;
+    }
+}
+
+/**
+ * @brief 直方图中的百分位数, 例如p为99时返回不小于99%的记录的延迟
+ * 
+ * 返回所在桶的上界(不超过max), 直方图为空时返回0.
+ */
+u64 ringbuf_latency_percentile(const struct ringbuf_latency *hist, double p)
+{
+    u64 rank, seen = 0;
+
+    if (!hist->total)
+        return 0;
+    rank = (u64)(p / 100 * hist->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (u32 i = 0; i < RB_LAT_BUCKETS; i++) {
+        seen += hist->count[i];
+        if (seen >= rank)
+            return MIN(rb_lat_bucket_min(i + 1) - 1, hist->max);
+    }
+    return hist->max;
+}
+
+/*
+ * print some state of ringbuffer 
+ */
+void ringbuf_show_state(struct ringbuf *buffer)
+{
+    struct list_head *p, *tmp;
+    struct buf_page_meta *page;
+
+    printf("ringbuf hdr:\n");
+    printf("- nr_page: %d\n", buffer->nr_page);
+    printf("- nr_entry: %llu\n", (unsigned long long)buffer->nr_entry);
+    printf("- nr_read: %llu\n", (unsigned long long)buffer->nr_read);
+    printf("- align: %d\n", buffer->align);
+    if (buffer->flags & RB_FL_LATENCY)
+        printf("- latency: %llu records, max %llu, missed %llu\n",
+                (unsigned long long)buffer->lat->total,
+                (unsigned long long)buffer->lat->max,
+                (unsigned long long)buffer->lat->missed);
+    if (rb_mirror(buffer)) {
+        printf("- mirror: <%p>, size: 0x%x, head: 0x%llx, tail: 0x%llx\n",
+                buffer->mirror, buffer->mirror_size,
+                (unsigned long long)buffer->mirror_head,
+                (unsigned long long)buffer->mirror_tail);
+        return;
+    }
+    if (buffer->hist)
+        printf("- history: %u pages, %llu -> %llu bytes\n", buffer->nr_hist,
+                (unsigned long long)buffer->hist_raw,
+                (unsigned long long)(buffer->hist_tail - buffer->hist_head));
+    printf("- reader_page: <0x%lx>\n", (unsigned long)buffer->reader_page);
+    printf("- head_page: <0x%lx>\n", (unsigned long)buffer->head_page);
+    printf("- tail_page: <0x%lx>\n", (unsigned long)buffer->tail_page);
+
+    printf("- entryof pages:\n");
+    p = &buffer->head_page->list;
+    tmp = p;
+    do {
+        page = list_entry(tmp, struct buf_page_meta, list);
+        printf("   <%p>, write: 0x%x, read: 0x%x\n", 
+                page, page->write, page->read);
+        tmp = rb_list_head(tmp->next);
+    } while (tmp != p);
 }
 
-#endif
@@ -10,67 +10,549 @@
  */
 #pragma once
 #include <stdint.h>
+#include <pthread.h>
+#ifdef __cplusplus
+// list.h 无法在C++中编译, C++只需要 struct list_head 的定义
+struct list_head {
+    struct list_head *next, *prev;
+};
+extern "C" {
+#else
 #include "list.h"
+#endif
 
 ////////////////////////////////////////////
 // Configuration of ringbuffer
 ////////////////////////////////////////////
 // #define RB_ALLOC_DYNAMIC       // 启用此定义代表所有内存分配使用malloc/free接口
-#define RB_STATIC_PAGES   (3)  // 如果采用静态定义方案，规定池子中的page数
-#define RB_ARCH_ALIGNMENT (4u) // 存入数据长度的对齐规则
+// 以下静态池的大小可以在编译时通过 -D 覆盖, 测试程序使用更大的值(见 Makefile)
+#ifndef RB_STATIC_BUFFERS
+#define RB_STATIC_BUFFERS (4)  // 如果采用静态定义方案，规定池子中的ringbuf数
+#endif
+#ifndef RB_STATIC_PAGES
+#define RB_STATIC_PAGES   (8)  // 如果采用静态定义方案，规定池子中的page数
+#endif
+#ifndef RB_STATIC_LATENCY
+#define RB_STATIC_LATENCY (1)  // 如果采用静态定义方案，规定可以使用 RB_FL_LATENCY 的ringbuf数
+#endif
+#define RB_ARCH_ALIGNMENT (4u) // 存入数据长度的默认对齐规则, 可通过 ringbuf_attr 按buffer修改
+#define RB_CACHELINE_SIZE (64u)
+// writer与reader各自修改的成员分别从新的cacheline开始. 定义 RB_NO_CACHELINE_SPLIT
+// 则不做对齐, 得到拆分之前的紧凑布局, 仅用于性能对比(见 make bench)
+#ifdef RB_NO_CACHELINE_SPLIT
+#define RB_CACHELINE_ALIGNED
+#else
+#define RB_CACHELINE_ALIGNED __attribute__((aligned(RB_CACHELINE_SIZE)))
+#endif
+// buf_page_meta 默认不拆分: page模式的writer与reader需要由caller互斥, 拆分后
+// 每个page的元数据从104字节变为192字节, 却没有测得收益. 定义 RB_PAGE_META_SPLIT
+// 按writer/reader拆分
+#ifdef RB_PAGE_META_SPLIT
+#define RB_PAGE_META_ALIGNED RB_CACHELINE_ALIGNED
+#else
+#define RB_PAGE_META_ALIGNED
+#endif
+#define RB_PAGE_SIZE      (0x1000u) // 每个page的大小(含page header)
+// #define RB_DEBUG               // 启用此定义代表打印内部调试信息
+// #define RB_USDT                // 启用此定义代表在慢路径上编译USDT探针(见 sdt.h), 可用perf/bpftrace跟踪
+#define RB_FLUSH_BATCH    (8)  // 后台flush线程每批最多写入的page数, 不超过32
+#define RB_FLUSH_INTERVAL_US (1000) // 后台flush线程没有满page时的轮询间隔
+// #define RB_IO_URING            // 启用此定义代表flush线程使用io_uring提交写入, 需要链接 -luring
+#define RB_LAZY_IDLE_NS   (1000000000ull) // RB_FL_LAZY: 读完的page空闲多久后释放物理内存, 以buffer的时钟计
+#define RB_NT_COPY_MIN    (2048u) // RB_FL_NT_COPY: 写入不短于此长度的数据时使用non-temporal store
+#define RB_LAT_SLOTS      (4096u) // RB_FL_LATENCY: 按序号保存commit时间的槽数(2的幂), 未消费的记录超过此数时较早的记录不计入直方图
+#define RB_LAT_SUB_BITS   (4)  // RB_FL_LATENCY: 直方图每个2的幂区间线性分为 2^RB_LAT_SUB_BITS 个桶
 
 typedef uint8_t u8;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 
 ////////////////////////////////////////////
 // Declaration of rinbuffer structure
 ////////////////////////////////////////////
 
+// item的type占5位, 最多32种. 按type过滤读取时使用type的位图
+#define RB_NR_TYPES      32
+#define RB_TYPE_MASK(type) (1u << (type))
+
 // ringbuf 中存储单元结构
 struct ringbuf_item {
-    // type: not used for now
+    // type: 记录的type, 由 ringbuf_write_type() 等指定, 见 RB_TYPE_MASK()
+    // frag: 大记录被拆分成多个分片时, 标识本分片的位置, 见 RB_FRAG_*
+    // ts: header之后跟随一个u32, 为相对于page时间戳的增量
     // len: exclude header
-    u32 type:5, len:27;
+    u32 type:5, frag:2, ts:1, len:24;
     u8 array[];
 };
 
+// 一条记录的读取视图, 适用于所有记录格式, 由 ringbuf_consume_entry() 填充
+struct ringbuf_entry {
+    void *data;
+    u32 len;
+    u32 type;
+    u64 seq;   // 记录的序号, 从0开始
+    u64 ts;    // 记录的时间戳, 没有逐条时间戳时为所在page的时间戳
+    u32 rate;  // RB_FL_SAMPLE: 记录被保留时的采样率, 即代表rate条记录; 否则为1
+    struct buf_page_meta *page; // 记录所在的page, ringbuf_consume_hold() 之后传给 ringbuf_release()
+};
+
+// 跨 page 大记录的一个分片, 由 ringbuf_consume_sg() 填充
+struct ringbuf_sg {
+    void *data;
+    u32 len;
+};
+
 // ring buffer 中一个完整的page, 其动态长度=PAGE_SIZE
 struct buf_page {
-    u32 time_stamp; // not used for now!
+    u64 time_stamp; // 该page上第一个item的时间戳
     u32 commit;     // 代表page中真实数据的大小，因为write有可能添加了padding
-                    // TODO: 是否可以放到 struct buf_page_meta 中？
+                    // 随page原样写入文件, 因此不放在 struct buf_page_meta 中
+    u32 crc;        // RB_FL_CRC: writer离开该page时计算的CRC32C
     u8 data[];
 };
 
 // 描述一个ringbuffer page
+// reader追上writer后两者位于同一个page. 定义 RB_PAGE_META_SPLIT 时writer和
+// reader修改的成员分别放在单独的cacheline中, 与很少修改的成员也分开
 struct buf_page_meta {
     struct list_head list;
-    u32 write, read;
-    u32 nr_entry;
+    u32 index;      // 在 ringbuf->page_index 中的位置
+    struct ringbuf_pool *pool; // 借自共享page池时非NULL
     struct buf_page *page;
+
+    // writer修改
+    u32 write RB_PAGE_META_ALIGNED;
+    u32 nr_entry;
+    u32 types;      // 从本page开始的记录的type位图, 见 RB_TYPE_MASK()
+    u32 resident;   // RB_FL_LAZY: page已被写入, 占用物理内存
+    u32 sample_shift; // RB_FL_SAMPLE: writer到达本page时的采样级别
+    u32 sample_first; // RB_FL_SAMPLE: 本page第一条记录的采样级别, 它在移动tail_page之前决定
+    u64 seq;        // 第一条从本page开始的记录的序号
+    u64 last_stamp; // 该page上最后一个item的时间戳
+
+    // reader修改
+    u32 read RB_PAGE_META_ALIGNED;
+    u32 dropped;    // 因校验失败或过期被整页跳过, 不保存到history
+    u32 hold;       // ringbuf_consume_hold() 返回的尚未释放的记录数, 不为0时writer不能进入
+    u64 drained;    // RB_FL_LAZY: page被读完放回环中的时间
+};
+
+/*
+ * RB_FL_LATENCY: 记录从commit到被consume的延迟(buffer的时钟, 默认ns)的直方图.
+ * log-linear分桶: 小于 2^RB_LAT_SUB_BITS 的值每个一桶, 之后每个2的幂区间
+ * 再线性分为 2^RB_LAT_SUB_BITS 个桶, 相对误差不超过 1/2^RB_LAT_SUB_BITS.
+ * 只有u64成员, 由 ringbuf_latency_read() 逐个读取.
+ */
+#define RB_LAT_BUCKETS ((64 - RB_LAT_SUB_BITS + 1) << RB_LAT_SUB_BITS)
+struct ringbuf_latency {
+    u64 count[RB_LAT_BUCKETS];
+    u64 total;      // 统计的记录数
+    u64 sum;        // 延迟之和
+    u64 max;
+    u64 missed;     // commit时间已被更新的记录覆盖, 没有统计的记录数
 };
 
 // 描述一个ringbuffer
+// 成员按修改者分到不同的cacheline: writer与reader在不同的CPU上运行时,
+// 只有发布给对方的位置(nr_entry/mirror_commit, mirror_free)会在CPU间传递.
 struct ringbuf {
-    struct buf_page_meta *head_page, *tail_page;
-    struct buf_page_meta *reader_page;
+    // 创建后很少修改, writer与reader都只读
     struct list_head *pages;
+    struct buf_page_meta **page_index; // 按环中顺序排列的page, 用于二分查找
     u32 nr_page;     // 包含多少page
-    u32 nr_entry;    // 存入的item数量
-    u32 nr_read;     // 已经读到的item数量
+    u32 align;       // item数据区的对齐
+    u32 data_start;  // page中第一个item的偏移, 使其数据区按align对齐
+    u32 record_size; // 固定长度记录模式下每条记录的长度, 0代表变长记录
+    u32 flags;       // RB_FL_*
+    u64 (*clock)(void);
+    // RB_FL_LATENCY: 第N条记录的commit时间存放在 lat_stamp[N % RB_LAT_SLOTS],
+    // reader消费时计算延迟计入lat
+    u64 *lat_stamp;
+    struct ringbuf_latency *lat;
+    // 共享page池, 参考 ringbuf_pool_init(). nr_page超过min_page的部分借自pool
+    struct ringbuf_pool *pool;
+    u32 min_page;    // 自有的page数
+    u32 max_page;    // 环中page数的上限, 也是page_index的容量
+    // RB_FL_MIRROR: 不使用page, 记录连续存放在被映射两次的数据区中.
+    // 以下mirror_*位置都单调递增, 对mirror_size取模后为在数据区中的偏移
+    u8 *mirror;
+    u32 mirror_size;
+    // ringbuf_set_trigger() 设置的触发条件
+    const struct ringbuf_trigger *trigger;
+    u64 max_age;     // 记录的保留时间, 0代表不限制, 参考 ringbuf_attr.max_age
+    const struct ringbuf_sampling *sampling; // RB_FL_SAMPLE
+    // 压缩的history区, 参考 ringbuf_attr.history. 按位置顺序存放读完的page
+    // 压缩后的block, hist_*位置都单调递增, 对hist_size取模后为在hist中的偏移
+    u8 *hist;
+    u32 hist_size;
+    struct buf_page_meta *hist_page; // 迭代器解压block的page
+    u8 *hist_scratch;                // 压缩page时的临时空间, 不能与hist_page共用
+
+    // writer独占
+    struct buf_page_meta *tail_page RB_CACHELINE_ALIGNED;
+    u64 mirror_tail; // writer保留到的位置
+    u8 lock;         // RB_FL_SNAPSHOT: writer从reserve到commit期间持有, reader消费时持有
+    u32 trig_state;  // RB_TRIG_ARMED ...
+    u32 trig_left;   // 条件满足后还要经过的commit数
+    u32 trig_type;   // 正在写入的记录, 在commit时检查
+    u32 trig_len;
+    const void *trig_data;
+    u32 sample_shift;             // RB_FL_SAMPLE: 当前的采样级别
+    u32 sample_seen[RB_NR_TYPES]; // RB_FL_SAMPLE: 各type上一条保留的记录之后丢弃的记录数
+    u64 nr_sampled_out;           // RB_FL_SAMPLE: 被采样丢弃的记录数
+
+    // writer发布, reader读取
+    u64 nr_entry RB_CACHELINE_ALIGNED; // 存入的item数量
+    u64 mirror_commit; // writer已提交的位置
+
+    // reader独占
+    struct buf_page_meta *reader_page RB_CACHELINE_ALIGNED;
+    struct buf_page_meta *head_page;
+    u64 nr_read;     // 已经读到的item数量
+    u64 mirror_head; // reader的位置
+    u32 nr_crc_err;  // RB_FL_CRC: 因校验失败而丢弃的page数
+    u64 lazy_check;  // RB_FL_LAZY: 上一次检查空闲page的时间
+    u64 nr_expired;  // max_age: 因过期而跳过的记录数
+    u64 expire_stamp; // max_age: last_stamp早于它的page已过期, 换入page时按需更新
+    u64 hist_head;   // history中最旧的block
+    u64 hist_tail;   // 下一个block写入的位置
+    u32 nr_hist;     // history中的page数
+    u64 hist_raw;    // history中的page压缩前的总长度
+
+    // reader发布, writer读取
+    u64 mirror_free RB_CACHELINE_ALIGNED; // reader已释放的位置, 之前的空间可以被writer重新使用
+};
+
+// 创建ringbuffer时可选的属性, 未设置(为0)的成员取默认值
+struct ringbuf_attr {
+    // item数据区的对齐, 2的幂, 取值范围[4, RB_CACHELINE_SIZE], 默认 RB_ARCH_ALIGNMENT.
+    // 只影响数据区的起始位置; 每条记录独占cacheline见 RB_FL_ISOLATE.
+    u32 align;
+    // 非0时启用固定长度记录模式: 每条记录长度都为record_size, 不含header,
+    // 第N条记录直接由下标计算得到. 该模式下只能通过 ringbuf_reserve()/
+    // ringbuf_write() 写入, ringbuf_consume_entry()/ringbuf_consume_records() 读取.
+    u32 record_size;
+    u32 flags;       // RB_FL_*
+    // 时间戳使用的时钟, 默认为 CLOCK_MONOTONIC 的纳秒数
+    u64 (*clock)(void);
+    // 非NULL时, 写满自有的page后从pool借用空page, 读完后归还
+    struct ringbuf_pool *pool;
+    // 使用pool时最多占用的空间(含自有的page), 0代表只受pool大小限制
+    u32 max_size;
+    // 保留记录的时间窗口(buffer的时钟), 需要 RB_FL_TIMESTAMP. 最新的记录
+    // 也早于窗口的page在reader到达时整页跳过, 0代表不限制
+    u64 max_age;
+    // RB_FL_SAMPLE 的采样配置, 在buffer释放前必须保持有效
+    const struct ringbuf_sampling *sampling;
+    // 非0时reader读完的page被压缩保存到这么大(字节, 至少2个page)的history区,
+    // 写满后丢弃最旧的page. 可以用 ringbuf_iter_history() 遍历
+    u32 history;
+};
+#define RB_ALIGN_CACHELINE RB_CACHELINE_SIZE
+
+/*
+ * 需要在 reserve/commit 时执行额外逻辑的特性都必须在 ringbuf->flags 中
+ * 置位, ringbuf.hpp 的内联快速路径只在 flags 为0时使用.
+ */
+
+// 使用紧凑的变长header: 数据长度不超过7字节的记录header只占1字节,
+// 更长的记录header为1字节type加varint长度. 记录按字节紧密排列, 不做对齐,
+// 只能通过 ringbuf_reserve()/ringbuf_write() 写入, ringbuf_consume_entry() 等读取.
+#define RB_FL_COMPACT (1u << 0)
+// 记录时间戳: 每个page记录首尾item的时间戳; 标准header的item还会
+// 额外记录4字节的时间戳增量, 从而可以精确到每条记录.
+#define RB_FL_TIMESTAMP (1u << 1)
+// 允许在writer运行时调用 ringbuf_snapshot(): writer从reserve到commit
+// 期间持有buffer的自旋锁, snapshot只在交换page环的指针时持有该锁.
+// 消费记录的接口也持有该锁, 以便trigger在commit中执行snapshot.
+#define RB_FL_SNAPSHOT (1u << 2)
+// writer离开page时(rb_move_tail)计算整页的CRC32C存入page header, reader换入
+// page时校验, 损坏的page整页丢弃并计入 ringbuf->nr_crc_err.
+// x86-64 上支持SSE4.2时使用crc32指令, 否则查表计算.
+#define RB_FL_CRC      (1u << 3)
+// page在writer第一次到达时(rb_move_tail)才被写入, 之前不占用物理内存.
+// 读完后在环中空闲超过 RB_LAZY_IDLE_NS 的page用 madvise(MADV_DONTNEED) 释放,
+// 仍保留在环中原来的位置, 再次写入时重新分配. 参考 ringbuf_release_idle().
+#define RB_FL_LAZY     (1u << 4)
+// 数据区是一个连续的环, 通过memfd在虚拟地址中紧挨着映射两次, 越过末尾的
+// 记录在第二个映射中仍然连续, 因此记录之间没有page末尾的padding.
+// writer与reader(各一个)之间lock-free. 只支持标准header的变长记录, 可以使用
+// reserve/commit, ringbuf_write()/ringbuf_consume()/ringbuf_consume_entry()等接口,
+// 不能与其他 RB_FL_* 及迭代器、snapshot、保存文件等基于page的功能一起使用.
+#define RB_FL_MIRROR   (1u << 5)
+// writer在commit时记录时间, reader在consume时把记录等待的时间计入直方图,
+// 参考 struct ringbuf_latency 及 ringbuf_latency_read(). 整页丢弃或由flush线程
+// 写出的记录不计入. 可以与 RB_FL_MIRROR 一起使用.
+#define RB_FL_LATENCY  (1u << 6)
+// 按填充率自动对写入的记录采样, 参考 struct ringbuf_sampling.
+// 需要设置 ringbuf_attr.sampling, 不能与 RB_FL_MIRROR 一起使用.
+#define RB_FL_SAMPLE   (1u << 7)
+// 不短于 RB_NT_COPY_MIN 的数据用non-temporal store写入(x86-64), 不把ring读入
+// writer的cache. 默认关闭: 每条记录多一次sfence, 单核上测得writer的尾延迟反而
+// 更高(见 make bench 的 bench_nt), 只有reader在另一个核上且writer的工作集
+// 对cache敏感时才可能受益, 使用前应实测.
+#define RB_FL_NT_COPY  (1u << 8)
+// 每条记录独占cacheline: header单独占用数据区之前的一个cacheline, 记录的数据
+// 不会与下一条记录的header共享cacheline. 1字节的记录也占用2个cacheline.
+// 需要 ringbuf_attr.align 为 RB_ALIGN_CACHELINE, 只支持标准header
+#define RB_FL_ISOLATE  (1u << 9)
+// 内部使用: 后台flush线程正在运行, writer需要加锁
+#define RB_FL_FLUSH    (1u << 30)
+// 内部使用: 已通过 ringbuf_set_trigger() 设置了触发条件
+#define RB_FL_TRIGGER  (1u << 31)
+
+/*
+ * commit时检查的触发条件: 记录的type等于type, 且payload中offset处长度为
+ * size字节的无符号整数与value的比较成立. 条件满足后再commit count条记录,
+ * 然后执行action: 停止接受写入, 或者对buffer执行一次 ringbuf_snapshot().
+ * snapshot在writer线程中交换reader_page/head_page, 只有带 RB_FL_SNAPSHOT
+ * 的buffer能使用, reader必须只通过消费接口读取.
+ */
+struct ringbuf_trigger {
+    u32 type;
+    u32 offset;
+    u32 size;      // 1, 2, 4, 8
+    u32 cmp;       // RB_CMP_*
+    u64 value;
+    u32 action;    // RB_TRIG_STOP, RB_TRIG_SNAPSHOT
+    u32 count;
+    // RB_TRIG_SNAPSHOT 使用, 同 ringbuf_snapshot(). 交换发生在writer的commit中,
+    // buffer须带有 RB_FL_SNAPSHOT, 消费接口由此与交换互斥; 迭代器/merge除外
+    struct ringbuf *spare;
+};
+#define RB_CMP_EQ  0
+#define RB_CMP_NE  1
+#define RB_CMP_LT  2
+#define RB_CMP_GE  3
+#define RB_CMP_AND 4   // (field & value) != 0
+
+#define RB_TRIG_STOP     0
+#define RB_TRIG_SNAPSHOT 1
+
+// ringbuf->trig_state
+#define RB_TRIG_NONE     0
+#define RB_TRIG_ARMED    1
+#define RB_TRIG_COUNTING 2
+#define RB_TRIG_FIRED    3
+
+/*
+ * RB_FL_SAMPLE: reader跟不上时按type对写入的记录采样. writer每移动到一个新的
+ * page, 按环中已使用的page占最多page数的比例(填充率, %)计算采样级别: 低于start
+ * 时为0, 即全部保留, 之后每增加step级别加1. type的采样率为 min(2^级别, max_rate[type]),
+ * 每rate条记录保留1条. 被丢弃的记录在reserve时直接返回NULL, 不写入header也不拷贝数据.
+ * 记录被保留时的采样率由 ringbuf_entry.rate 返回, 用于还原计数. 采样率不保存到
+ * ringbuf_save() 及flusher写入的文件中.
+ */
+struct ringbuf_sampling {
+    u32 start;                 // 开始采样的填充率(%)
+    u32 step;                  // 采样级别每加1需要增加的填充率(%), 不能为0
+    u32 max_rate[RB_NR_TYPES]; // 各type采样率的上限, 0或1代表该type从不采样
+};
+
+// 不消费数据的迭代器, 从reader当前位置开始遍历
+struct ringbuf_iter {
+    struct ringbuf *buffer;
+    struct buf_page_meta *page;
+    u32 head;   // 在page中的偏移
+    u64 seq;    // 下一条记录的序号
+    u64 hist;   // 遍历history时下一个block的位置, 参考 ringbuf_iter_history()
+};
+
+// 按时间戳合并读取多个buffer, 参考 ringbuf_merge_next()
+#define RB_MERGE_MAX 32
+struct ringbuf_merge {
+    struct ringbuf *buffers[RB_MERGE_MAX];
+    u64 ts[RB_MERGE_MAX];    // 各buffer下一条记录的时间戳
+    u8 heap[RB_MERGE_MAX];   // 按ts排列的小顶堆, 元素为buffers的下标
+    u32 nr_buffer;
+    u32 nr_heap;
+    u32 in_heap;             // 在堆中的buffer的位图
+    int pending;             // 上一次返回的记录所在的buffer, -1代表没有
+};
+
+/*
+ * 磁盘文件格式, 由 ringbuf_save() 写入:
+ * 文件头 struct ringbuf_file_hdr, 补齐到page_size; 之后是nr_page个page,
+ * 每个都是内存中 struct buf_page 的原样拷贝, 按reader的读取顺序排列.
+ * page在文件中按page_size对齐, 可以直接mmap后解析.
+ * 所有字段均为写入端的本机字节序, 由byte_order区分.
+ * 采样级别等只在 struct buf_page_meta 中的信息不写入文件, 因此从文件中
+ * 读出的记录 ringbuf_entry.rate 总为1, 不能还原 RB_FL_SAMPLE 丢弃的记录数.
+ */
+#define RB_FILE_MAGIC   "RINGBUF\0"
+#define RB_FILE_VERSION 3
+#define RB_FILE_BYTE_ORDER 0x01020304u
+
+// ringbuf_file_hdr->clock
+#define RB_CLOCK_NONE      0   // 没有 RB_FL_TIMESTAMP
+#define RB_CLOCK_MONOTONIC 1   // 默认时钟, CLOCK_MONOTONIC 的纳秒数
+#define RB_CLOCK_CUSTOM    2   // ringbuf_attr.clock 指定的时钟
+
+struct ringbuf_file_hdr {
+    char magic[8];
+    u32 version;
+    u32 byte_order;
+    u32 page_size;
+    u32 page_hdr_size;  // struct buf_page 中data的偏移
+    u32 align;          // 以下4个成员与 struct ringbuf 相同, 描述记录格式
+    u32 data_start;
+    u32 record_size;
+    u32 flags;          // 只保留 RB_FL_COMPACT, RB_FL_TIMESTAMP, RB_FL_CRC 和 RB_FL_ISOLATE
+    u32 clock;          // RB_CLOCK_*
+    u32 nr_page;
+    u32 first_offset;   // 第一条记录在第一个page中的偏移, 之前的记录已被消费
+    u32 reserved;
+    u64 first_seq;      // 第一条记录的序号
+    u64 nr_entry;       // 文件中完整记录的数量
+};
+
+// 读取 ringbuf_save() 写入的文件
+struct ringbuf_file {
+    const struct ringbuf_file_hdr *hdr;
+    u64 size;           // mmap的长度
+    struct ringbuf fmt; // 只有描述记录格式的成员有效
+    struct buf_page_meta meta;
+    u32 page;           // 当前page的下标
+    u64 seq;            // 下一条记录的序号, 丢弃损坏的page后不再准确
+    u32 nr_crc_err;     // 校验失败而跳过的page数
+};
+
+/*
+ * 后台flush线程, 参考 ringbuf_flush_start().
+ * 线程把写满的page从环中换出写入文件, 写完后作为空page换回环中.
+ */
+struct ringbuf_flusher {
+    struct ringbuf *buffer;
+    int fd;
+    int stop;
+    int error;          // 写文件失败后线程退出
+    pthread_t thread;
+    u64 offset;         // 下一个page在文件中的偏移
+    struct ringbuf_file_hdr hdr;
+    struct buf_page_meta *spare[RB_FLUSH_BATCH]; // 用于换出满page的空page, 换出后为正在写入的满page
+    u32 busy;           // RB_IO_URING: 正在写入的spare的位图
+    u64 busy_off[RB_FLUSH_BATCH]; // RB_IO_URING: 正在写入的spare在文件中的偏移
+    void *uring;        // RB_IO_URING: struct io_uring
+};
+
+/*
+ * 多个buffer共享的page池, 参考 ringbuf_pool_init().
+ * 空闲page组成一个lock-free的栈, free的低32位是栈顶page的下标加1(0代表空),
+ * 高32位是每次修改都递增的版本号, 防止ABA. 空闲page的index成员用作next.
+ */
+struct ringbuf_pool {
+    u64 free;
+    u32 nr_page;        // 池中的page总数, 即所有buffer借用的上限
+    u32 nr_free;        // 当前空闲的page数
+    struct buf_page_meta *pages;
 };
 
+/*
+ * 多个lane(各自是一个ringbuf)组成的buffer, 参考 ringbuf_lanes_init().
+ * lanes[0]优先级最高. 各lane写满自有的page后从共享的pool借用page,
+ * 读取时按 RB_DRAIN_* 在lane之间选择, 高优先级的记录不会排在大量
+ * 低优先级记录之后.
+ */
+#define RB_LANES_MAX 8
+
+// lane写满时的处理
+#define RB_LANE_DROP_NEW 0 // 写入失败, 丢弃新记录
+#define RB_LANE_DROP_OLD 1 // 丢弃lane中最旧的记录, 由writer在lane的锁内消费
+
+// 读取时选择lane的方式
+#define RB_DRAIN_PRIORITY 0 // 总是读取有数据的lane中优先级最高的
+#define RB_DRAIN_WEIGHTED 1 // 加权轮询, 每轮从各lane最多读取weight条记录
+
+struct ringbuf_lane_attr {
+    u32 size;                 // lane自有的空间, 同 ringbuf_alloc_attr() 的size
+    u32 policy;               // RB_LANE_*
+    u32 weight;               // RB_DRAIN_WEIGHTED: 每轮最多读取的记录数, 0视为1
+    struct ringbuf_attr attr; // lane的其他属性, pool由 ringbuf_lanes_init() 设置
+};
+
+struct ringbuf_lanes {
+    struct ringbuf *lanes[RB_LANES_MAX];
+    u32 policy[RB_LANES_MAX];
+    u32 weight[RB_LANES_MAX];
+    u64 nr_dropped[RB_LANES_MAX]; // 因lane写满而丢弃的记录数
+    u8 lock[RB_LANES_MAX];        // ringbuf_lanes_write()/ringbuf_lanes_consume() 访问lane时持有
+    u32 nr_lane;
+    u32 drain;       // RB_DRAIN_*
+    u32 cur;         // RB_DRAIN_WEIGHTED: 正在读取的lane
+    u32 credit;      // RB_DRAIN_WEIGHTED: 本轮还可以从cur读取的记录数
+    struct ringbuf_pool pool; // 各lane共享的page
+};
+
+int  ringbuf_pool_init(struct ringbuf_pool *pool, u32 nr_pages);
+void ringbuf_pool_destroy(struct ringbuf_pool *pool);
+
+int  ringbuf_lanes_init(struct ringbuf_lanes *lanes, const struct ringbuf_lane_attr *attrs,
+        u32 nr, u32 shared, u32 drain);
+void ringbuf_lanes_destroy(struct ringbuf_lanes *lanes);
+int  ringbuf_lanes_write(struct ringbuf_lanes *lanes, u32 lane, u32 length, void *data);
+int  ringbuf_lanes_consume(struct ringbuf_lanes *lanes, struct ringbuf_entry *entry,
+        u32 *lane);
+
 struct ringbuf * ringbuf_alloc_static(u32 size);
 struct ringbuf * ringbuf_alloc(u32 size);
+struct ringbuf * ringbuf_alloc_attr(u32 size, const struct ringbuf_attr *attr);
 void ringbuf_free(struct ringbuf *buffer);
+struct ringbuf * ringbuf_alloc_snapshot(struct ringbuf *buffer);
+struct ringbuf * ringbuf_snapshot(struct ringbuf *buffer, struct ringbuf *spare);
+void ringbuf_set_trigger(struct ringbuf *buffer, const struct ringbuf_trigger *trig);
+int  ringbuf_trigger_fired(struct ringbuf *buffer);
 void ringbuf_show_state(struct ringbuf *buffer);
+u32  ringbuf_release_idle(struct ringbuf *buffer);
+u64  ringbuf_expire(struct ringbuf *buffer);
+void ringbuf_latency_read(struct ringbuf *buffer, struct ringbuf_latency *hist, int reset);
+u64  ringbuf_latency_percentile(const struct ringbuf_latency *hist, double p);
 
 int  ringbuf_write(struct ringbuf *buffer, u32 length, void *data);
+int  ringbuf_write_type(struct ringbuf *buffer, u32 type, u32 length, void *data);
 void ringbuf_commit(struct ringbuf *buffer, struct ringbuf_item *item);
 struct ringbuf_item * ringbuf_reserve_item(struct ringbuf *buffer, u32 length);
 struct ringbuf_item * ringbuf_consume(struct ringbuf *buffer);
 
+void * ringbuf_reserve(struct ringbuf *buffer, u32 length);
+void * ringbuf_reserve_type(struct ringbuf *buffer, u32 type, u32 length);
+void   ringbuf_commit_data(struct ringbuf *buffer, void *data);
+
+void ringbuf_iter_start(struct ringbuf_iter *iter, struct ringbuf *buffer);
+void ringbuf_iter_history(struct ringbuf_iter *iter, struct ringbuf *buffer);
+int  ringbuf_iter_next(struct ringbuf_iter *iter, struct ringbuf_entry *entry);
+int  ringbuf_iter_next_filter(struct ringbuf_iter *iter, u32 mask,
+        struct ringbuf_entry *entry);
+int  ringbuf_seek_seq(struct ringbuf_iter *iter, u64 seq);
+int  ringbuf_seek_time(struct ringbuf_iter *iter, u64 ts);
+int  ringbuf_save(struct ringbuf *buffer, int fd);
+int  ringbuf_flush_start(struct ringbuf_flusher *flusher, struct ringbuf *buffer, int fd);
+int  ringbuf_flush_stop(struct ringbuf_flusher *flusher);
+int  ringbuf_file_open(struct ringbuf_file *file, const char *path);
+int  ringbuf_file_next(struct ringbuf_file *file, struct ringbuf_entry *entry);
+void ringbuf_file_close(struct ringbuf_file *file);
+
+void ringbuf_merge_init(struct ringbuf_merge *merge, struct ringbuf **buffers, u32 nr);
+int  ringbuf_merge_next(struct ringbuf_merge *merge, struct ringbuf_entry *entry,
+        u32 *index);
+int    ringbuf_peek_entry(struct ringbuf *buffer, struct ringbuf_entry *entry);
+int    ringbuf_consume_entry(struct ringbuf *buffer, struct ringbuf_entry *entry);
+int    ringbuf_consume_filter(struct ringbuf *buffer, u32 mask,
+        struct ringbuf_entry *entry);
+int    ringbuf_consume_hold(struct ringbuf *buffer, struct ringbuf_entry *entry);
+void   ringbuf_release(struct ringbuf *buffer, const struct ringbuf_entry *entry);
+u32    ringbuf_consume_records(struct ringbuf *buffer, void **records, u32 nr);
+
+u32  ringbuf_peek_length(struct ringbuf *buffer, u32 *nr_frag);
+u32  ringbuf_consume_sg(struct ringbuf *buffer, struct ringbuf_sg *sg, u32 nr_sg);
+u32  ringbuf_consume_copy(struct ringbuf *buffer, void *dst, u32 size);
+
     
 void * ringbuf_item_data(struct ringbuf_item *item);
 u32    ringbuf_item_data_length(struct ringbuf_item *item);
+u32    ringbuf_item_size(struct ringbuf *buffer, u32 length);
+int    ringbuf_item_is_fragment(struct ringbuf_item *item);
+
+#ifdef __cplusplus
+}
+#endif
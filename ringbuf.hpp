@@ -0,0 +1,193 @@
+/**
+ * @file ringbuf.hpp
+ * @brief  C++ 封装, header-only
+ *
+ * rb::ringbuf<T> 以固定长度记录模式(record_size = sizeof(T))
+ * 创建 ringbuffer. 长度/对齐的计算均为 constexpr, 写入和读取在当前
+ * page 内时内联 ringbuf_core.h 中的快速路径(与 ringbuf.c 共用),
+ * 只有跨 page 时才调用 ringbuf.c 中的接口.
+ * page 大小不是模板参数, 固定为编译 ringbuf.c 时的 RB_PAGE_SIZE.
+ *
+ * 读取返回的 view 持有记录直到析构, 析构时才真正消费该记录,
+ * 因此记录在 view 的生命周期内始终有效. 同一时刻只能持有一个 view.
+ *
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ */
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#define RB_CORE_FAST_PATH
+#include "ringbuf_core.h"
+
+namespace rb {
+
+template <typename T>
+class ringbuf {
+    static_assert(std::is_trivially_copyable<T>::value &&
+                  std::is_trivially_destructible<T>::value,
+                  "records are stored as raw bytes");
+
+    static constexpr u32 align_up(u32 x, u32 a) { return (x + a - 1) & ~(a - 1); }
+
+public:
+    // 与 ringbuf.c 中固定长度记录模式的布局一致
+    static constexpr u32 align = alignof(T) < RB_ARCH_ALIGNMENT ?
+                                 RB_ARCH_ALIGNMENT : alignof(T);
+    static constexpr u32 page_hdr = offsetof(struct buf_page, data);
+    static constexpr u32 page_data = RB_PAGE_SIZE - page_hdr;
+    static constexpr u32 data_start = (align - page_hdr % align) % align;
+    static constexpr u32 slot = align_up(sizeof(T), align);
+    static constexpr u32 per_page = (page_data - data_start) / slot;
+
+    static_assert(align <= RB_CACHELINE_SIZE, "alignment not supported");
+    static_assert(per_page > 0, "record larger than a page");
+
+    // 持有一条已读取但尚未消费的记录, move-only
+    class view {
+    public:
+        view() = default;
+        view(const view &) = delete;
+        view &operator=(const view &) = delete;
+        view(view &&o) noexcept : owner_(o.owner_), rec_(o.rec_) { o.owner_ = nullptr; }
+        view &operator=(view &&o) noexcept
+        {
+            if (this != &o) {
+                release();
+                owner_ = o.owner_;
+                rec_ = o.rec_;
+                o.owner_ = nullptr;
+            }
+            return *this;
+        }
+        ~view() { release(); }
+
+        explicit operator bool() const { return owner_ != nullptr; }
+        const T &operator*() const { return *rec_; }
+        const T *operator->() const { return rec_; }
+        const T *get() const { return rec_; }
+
+        // 提前消费该记录
+        void release()
+        {
+            if (owner_)
+                owner_->advance();
+            owner_ = nullptr;
+        }
+
+    private:
+        friend class ringbuf;
+        view(ringbuf *owner, const T *rec) : owner_(owner), rec_(rec) {}
+
+        ringbuf *owner_ = nullptr;
+        const T *rec_ = nullptr;
+    };
+
+    explicit ringbuf(u32 size)
+    {
+        struct ringbuf_attr attr = {};
+
+        attr.align = align;
+        attr.record_size = sizeof(T);
+        buf_ = ringbuf_alloc_attr(size, &attr);
+    }
+    ~ringbuf()
+    {
+        assert(!pending_);
+        if (buf_)
+            ringbuf_free(buf_);
+    }
+    ringbuf(const ringbuf &) = delete;
+    ringbuf &operator=(const ringbuf &) = delete;
+
+    struct ::ringbuf *handle() { return buf_; }
+
+    // 保留一条记录的空间, 写入后调用 commit()
+    T *reserve()
+    {
+        // flags == 0 时没有时间戳, 固定长度记录的type总为0
+        if (fast() && rb_page_fits(buf_, slot))
+            return static_cast<T *>(rb_page_claim(buf_, slot, 0, 0));
+        return static_cast<T *>(ringbuf_reserve(buf_, sizeof(T)));
+    }
+
+    void commit(T *rec)
+    {
+        if (fast()) {
+            rb_page_publish(buf_);
+            return;
+        }
+        ringbuf_commit_data(buf_, rec);
+    }
+
+    template <typename... Args>
+    bool emplace(Args &&...args)
+    {
+        T *p = reserve();
+
+        if (!p)
+            return false;
+        new (p) T(std::forward<Args>(args)...);
+        commit(p);
+        return true;
+    }
+
+    bool write(const T &rec) { return emplace(rec); }
+
+    // 取出下一条记录, 记录在返回的 view 析构时才被消费
+    view consume()
+    {
+        const T *rec = peek();
+
+        if (!rec)
+            return view();
+        pending_ = true;
+        return view(this, rec);
+    }
+
+    u32 size() const { return rb_num_of_entry(buf_); }
+    bool empty() const { return size() == 0; }
+
+private:
+    bool fast() const { return buf_->flags == 0; }
+
+    const T *peek()
+    {
+        struct ringbuf_entry entry;
+        void *rec;
+
+        // 上一个 view 尚未释放时, 读到的仍是同一条记录
+        assert(!pending_);
+        if (empty())
+            return nullptr;
+        if (fast() && (rec = rb_reader_page_peek(buf_)))
+            return static_cast<const T *>(rec);
+        // 需要切换 reader page
+        if (!ringbuf_peek_entry(buf_, &entry))
+            return nullptr;
+        return static_cast<const T *>(entry.data);
+    }
+
+    // peek() 之后记录总在 reader page 上, 直接前进即可
+    void advance()
+    {
+        struct ringbuf_entry entry;
+
+        pending_ = false;
+        if (fast()) {
+            rb_reader_page_advance(buf_, slot, 1);
+            return;
+        }
+        ringbuf_consume_entry(buf_, &entry);
+    }
+
+    struct ::ringbuf *buf_ = nullptr;
+    bool pending_ = false;
+};
+
+} // namespace rb
@@ -0,0 +1,377 @@
+/**
+ * @file ringbuf_bench.c
+ * @brief  ringbuffer的性能测试程序, 使用 make bench 编译运行
+ * @version 0.1
+ * @date 2026-10-19
+ * 
+ * @copyright Copyright (c) 2026
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "ringbuf.h"
+
+#define BENCH_PAGES   (64)
+#define BENCH_RECORDS (1u << 21)
+
+static volatile u64 bench_sink;  // 防止读取被优化掉
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* consumer 按8字节读取记录的所有字段 */
+static u64 sum_payload(const void *data, u32 len)
+{
+    const u8 *p = data;
+    u64 sum = 0, v;
+
+    for (u32 i = 0; i + sizeof(v) <= len; i += sizeof(v)) {
+        memcpy(&v, p + i, sizeof(v));
+        sum += v;
+    }
+    return sum;
+}
+
+/*
+ * 不同对齐下的写入+读取耗时, 以及padding带来的空间浪费.
+ * 对齐越大, 数据区的load越友好, 但每条记录占用的空间也越多.
+ * 最后一组为 RB_FL_ISOLATE, header另占一个cacheline(align列标记为64i).
+ */
+static void bench_align(void)
+{
+    u32 aligns[] = { 4, 8, 16, RB_ALIGN_CACHELINE, RB_ALIGN_CACHELINE };
+    u32 flags[] = { 0, 0, 0, 0, RB_FL_ISOLATE };
+    const char *names[] = { "4", "8", "16", "64", "64i" };
+    u32 sizes[] = { 8, 24, 100, 1000 };
+    struct ringbuf_attr attr = { 0 };
+    struct ringbuf *buffer;
+    struct ringbuf_item *item;
+    static u8 data[1024];
+    u64 start, elapsed;
+    u32 batch, space;
+
+    printf("%-6s %-6s %-10s %-10s %-10s\n",
+            "align", "size", "space", "efficiency%", "ns/record");
+    for (int a = 0; a < sizeof(aligns)/sizeof(aligns[0]); a++) {
+        for (int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+            attr.align = aligns[a];
+            attr.flags = flags[a];
+            buffer = ringbuf_alloc_attr(BENCH_PAGES * 4096, &attr);
+            space = ringbuf_item_size(buffer, sizes[s]);
+            // 每批写入约半个buffer, 之后全部读出
+            batch = BENCH_PAGES / 2 * 4000 / space;
+
+            start = now_ns();
+            for (u32 done = 0; done < BENCH_RECORDS; done += batch) {
+                for (u32 i = 0; i < batch; i++)
+                    ringbuf_write(buffer, sizes[s], data);
+                for (u32 i = 0; i < batch; i++) {
+                    item = ringbuf_consume(buffer);
+                    bench_sink += sum_payload(ringbuf_item_data(item),
+                            ringbuf_item_data_length(item));
+                }
+            }
+            elapsed = now_ns() - start;
+
+            printf("%-6s %-6u %-10u %-10.1f %-10.2f\n", names[a], sizes[s],
+                    space, 100.0 * sizes[s] / space,
+                    (double)elapsed / BENCH_RECORDS);
+            ringbuf_free(buffer);
+        }
+    }
+}
+
+/*
+ * RB_FL_CRC 的开销: writer每离开一个page计算一次整页的CRC32C,
+ * reader换入page时再校验一次. 对比开启前后的写入+读取带宽.
+ * 
+ * CRC的开销与写入的字节数成正比(每KiB的ring空间两遍CRC32C), 而写入+读取
+ * 本身的开销主要是每条记录固定的部分, 记录越长, 百分比越高. crc ns/KiB
+ * 一列应当基本不随记录长度变化.
+ */
+static void bench_crc(void)
+{
+    u32 flags[] = { 0, RB_FL_CRC };
+    u32 sizes[] = { 16, 64, 256, 1024 };
+    struct ringbuf_attr attr = { 0 };
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    static u8 data[1024];
+    u64 start, elapsed[2];
+    u32 batch, space;
+
+    printf("\n%-6s %-12s %-12s %-10s %-12s\n",
+            "size", "MB/s", "MB/s(crc)", "overhead%", "crc ns/KiB");
+    for (int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        for (int f = 0; f < 2; f++) {
+            attr.flags = flags[f];
+            buffer = ringbuf_alloc_attr(BENCH_PAGES * 4096, &attr);
+            space = ringbuf_item_size(buffer, sizes[s]);
+            batch = BENCH_PAGES / 2 * 4000 / space;
+
+            start = now_ns();
+            for (u32 done = 0; done < BENCH_RECORDS; done += batch) {
+                for (u32 i = 0; i < batch; i++)
+                    ringbuf_write(buffer, sizes[s], data);
+                for (u32 i = 0; i < batch; i++) {
+                    ringbuf_consume_entry(buffer, &entry);
+                    bench_sink += entry.len;
+                }
+            }
+            elapsed[f] = now_ns() - start;
+            ringbuf_free(buffer);
+        }
+        printf("%-6u %-12.1f %-12.1f %-10.1f %-12.1f\n", sizes[s],
+                (double)sizes[s] * BENCH_RECORDS * 1000 / elapsed[0],
+                (double)sizes[s] * BENCH_RECORDS * 1000 / elapsed[1],
+                100.0 * ((double)elapsed[1] - elapsed[0]) / elapsed[0],
+                ((double)elapsed[1] - elapsed[0]) * 1024 / ((double)space * BENCH_RECORDS));
+    }
+}
+
+/*
+ * 1~3KiB的记录在page模式下放不进当前page时, page剩余的空间被浪费;
+ * RB_FL_MIRROR 的记录可以越过page边界及数据区末尾. 对比写满buffer时
+ * 的空间利用率, 以及写入+读取的耗时.
+ */
+static void bench_mirror(void)
+{
+    u32 flags[] = { 0, RB_FL_MIRROR };
+    const char *names[] = { "page", "mirror" };
+    struct ringbuf_attr attr = { 0 };
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    static u8 data[3072];
+    u64 start, elapsed, stored;
+    u32 n, batch;
+
+    printf("\n%-8s %-10s %-10s\n", "mode", "used%", "ns/record");
+    for (int f = 0; f < 2; f++) {
+        attr.flags = flags[f];
+        buffer = ringbuf_alloc_attr(BENCH_PAGES * 4096, &attr);
+
+        for (n = 0, stored = 0; ; n++) {
+            u32 len = 1024 + n * 7919 % 2048;
+            if (ringbuf_write(buffer, len, data))
+                break;
+            stored += len;
+        }
+        while (ringbuf_consume_entry(buffer, &entry))
+            ;
+        // 每批写入约半个buffer, 之后全部读出
+        batch = n / 2;
+
+        start = now_ns();
+        for (u32 done = 0; done < BENCH_RECORDS / 16; done += batch) {
+            for (u32 i = 0; i < batch; i++)
+                ringbuf_write(buffer, 1024 + i * 7919 % 2048, data);
+            for (u32 i = 0; i < batch; i++) {
+                ringbuf_consume_entry(buffer, &entry);
+                bench_sink += sum_payload(entry.data, entry.len);
+            }
+        }
+        elapsed = now_ns() - start;
+
+        printf("%-8s %-10.1f %-10.2f\n", names[f],
+                100.0 * stored / (BENCH_PAGES * 4096),
+                (double)elapsed / (BENCH_RECORDS / 16));
+        ringbuf_free(buffer);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+#define NT_RECORDS (1u << 16)
+#define NT_WORKSET (128 * 1024)
+
+/*
+ * 大记录写入时普通memcpy会把ring的cacheline读入writer的cache, 挤出writer
+ * 自己的工作集. 每写一条3000字节的记录前, writer先遍历128KiB的工作集,
+ * 统计(遍历+写入)的延迟分布. 两组都使用 ringbuf_write(), 区别只在于
+ * buffer是否设置了 RB_FL_NT_COPY.
+ */
+static void bench_nt(void)
+{
+    u32 flags[] = { 0, RB_FL_NT_COPY };
+    const char *names[] = { "memcpy", "nt" };
+    struct ringbuf_attr attr = { 0 };
+    static u64 lat[NT_RECORDS];
+    static u8 workset[NT_WORKSET];
+    static u8 data[3000];
+    struct ringbuf_entry entry;
+    struct ringbuf *buffer;
+    u64 start, sum = 0;
+    u32 len = sizeof(data), batch;
+
+    printf("\n%-8s %-10s %-10s %-10s\n", "copy", "p50(ns)", "p99(ns)", "p99.9(ns)");
+    for (int m = 0; m < 2; m++) {
+        // ring远大于cache, 写入的地址总是冷的
+        attr.flags = flags[m];
+        buffer = ringbuf_alloc_attr(1024 * 4096, &attr);
+        batch = 512;
+        memset(workset, m, sizeof(workset));
+
+        for (u32 n = 0; n < NT_RECORDS; n++) {
+            start = now_ns();
+            for (u32 i = 0; i < NT_WORKSET; i += 64)
+                sum += workset[i];
+            ringbuf_write(buffer, len, data);
+            lat[n] = now_ns() - start;
+            if ((n + 1) % batch == 0) {
+                for (u32 i = 0; i < batch; i++) {
+                    ringbuf_consume_entry(buffer, &entry);
+                    bench_sink += entry.len;
+                }
+            }
+        }
+        bench_sink += sum;
+        qsort(lat, NT_RECORDS, sizeof(lat[0]), cmp_u64);
+        printf("%-8s %-10llu %-10llu %-10llu\n", names[m],
+                (unsigned long long)lat[NT_RECORDS / 2],
+                (unsigned long long)lat[NT_RECORDS * 99 / 100],
+                (unsigned long long)lat[NT_RECORDS * 999 / 1000]);
+        ringbuf_free(buffer);
+    }
+}
+
+#define XCORE_RECORDS (1u << 22)
+
+// 有多个CPU时把线程固定在指定的CPU上
+static void pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * page模式的reader与writer不能并发, 由bench加锁串行; RB_FL_MIRROR 在
+ * 一个writer与一个reader之间lock-free, 不加锁
+ */
+struct xcore {
+    struct ringbuf *buffer;
+    pthread_spinlock_t lock;
+    int locked;
+};
+
+static void *xcore_writer(void *arg)
+{
+    struct xcore *x = arg;
+    u64 data[2] = { 0 };
+    int ret;
+
+    pin_cpu(1);
+    for (u32 i = 0; i < XCORE_RECORDS; ) {
+        data[0] = i;
+        if (x->locked)
+            pthread_spin_lock(&x->lock);
+        ret = ringbuf_write(x->buffer, sizeof(data), data);
+        if (x->locked)
+            pthread_spin_unlock(&x->lock);
+        if (ret) {
+            sched_yield();
+            continue;
+        }
+        i++;
+    }
+    return NULL;
+}
+
+/*
+ * writer与reader在不同的CPU上, 每条记录16字节. writer与reader各自修改的
+ * 控制字段如果在同一个cacheline中, 每次操作都会使对方的cacheline失效.
+ * 对照组 ringbuf_bench_packed 以 RB_NO_CACHELINE_SPLIT 编译, 两者比较同一行.
+ * 
+ * 只有mirror模式的writer与reader可以无锁并发. page模式的reader换入page时
+ * 会修改环, 与writer移动tail_page之间没有同步, 只能加锁运行: 锁所在的
+ * cacheline在两个CPU之间来回传递, 掩盖了控制字段的布局差异, 这一行只作参考.
+ * 编译时加上 -DRB_PAGE_META_SPLIT 可以比较拆分 buf_page_meta 的效果.
+ */
+static void bench_cross_core(void)
+{
+    u32 flags[] = { 0, RB_FL_MIRROR };
+    const char *names[] = { "page", "mirror" };
+    struct ringbuf_attr attr = { 0 };
+    struct ringbuf_entry entry;
+    struct xcore x;
+    pthread_t thread;
+    u64 start, elapsed;
+    int ret;
+
+#ifdef RB_NO_CACHELINE_SPLIT
+    printf("\npacked layout, buf_page_meta %zu bytes, ringbuf %zu bytes\n",
+            sizeof(struct buf_page_meta), sizeof(struct ringbuf));
+#else
+    printf("\nsplit layout, buf_page_meta %zu bytes, ringbuf %zu bytes\n",
+            sizeof(struct buf_page_meta), sizeof(struct ringbuf));
+#endif
+    printf("page mode runs under a spinlock, only mirror mode is lock-free\n");
+    printf("%-8s %-6s %-10s %-10s\n", "mode", "cpus", "ns/record", "Mrecords/s");
+    pthread_spin_init(&x.lock, PTHREAD_PROCESS_PRIVATE);
+    for (int f = 0; f < 2; f++) {
+        attr.flags = flags[f];
+        x.buffer = ringbuf_alloc_attr(BENCH_PAGES * 4096, &attr);
+        x.locked = !(flags[f] & RB_FL_MIRROR);
+        pin_cpu(0);
+        start = now_ns();
+        pthread_create(&thread, NULL, xcore_writer, &x);
+        for (u32 n = 0; n < XCORE_RECORDS; ) {
+            if (x.locked)
+                pthread_spin_lock(&x.lock);
+            ret = ringbuf_consume_entry(x.buffer, &entry);
+            if (ret)
+                bench_sink += *(u64 *)entry.data;
+            if (x.locked)
+                pthread_spin_unlock(&x.lock);
+            if (!ret) {
+                sched_yield();
+                continue;
+            }
+            n++;
+        }
+        pthread_join(thread, NULL);
+        elapsed = now_ns() - start;
+
+        printf("%-8s %-6ld %-10.2f %-10.2f\n", names[f],
+                sysconf(_SC_NPROCESSORS_ONLN),
+                (double)elapsed / XCORE_RECORDS,
+                (double)XCORE_RECORDS * 1000 / elapsed);
+        ringbuf_free(x.buffer);
+    }
+    pthread_spin_destroy(&x.lock);
+}
+
+int main()
+{
+#ifdef RB_NO_CACHELINE_SPLIT
+    // 对照组只比较跨CPU的测试
+    bench_cross_core();
+    return 0;
+#endif
+    bench_align();
+    bench_crc();
+    bench_mirror();
+    bench_nt();
+    bench_cross_core();
+    return 0;
+}
@@ -3,7 +3,8 @@
  * @author wangloo (cnwanglu@icloud.com)
  * @brief  define some internel and core functions.
  *         should be included after standard libaraies.
- *         内部使用，不应该暴露给外部
+ *         内部使用，不应该暴露给外部; ringbuf.hpp 只使用其中的
+ *         page 内快速路径(RB_CORE_FAST_PATH)
  * @version 0.1
  * @date 2023-04-28
  * 
@@ -13,10 +14,124 @@
 #pragma once
 #include "ringbuf.h"
 
-#define PAGE_SIZE   0x1000
-
 #define BUF_PAGE_HDR_SIZE (offsetof(struct buf_page, data))
-#define BUF_PAGE_SIZE (PAGE_SIZE - BUF_PAGE_HDR_SIZE)
+#define BUF_PAGE_SIZE (RB_PAGE_SIZE - BUF_PAGE_HDR_SIZE)
+
+////////////////////////////////////////////
+// page 内的快速路径
+////////////////////////////////////////////
+/*
+ * 本节只访问 ringbuf.h 中的结构, 也可以作为C++编译. ringbuf.hpp 定义
+ * RB_CORE_FAST_PATH 后包含本文件, 只得到本节, 用来内联固定长度记录在
+ * 当前page内的读写, 与 ringbuf.c 共用同一份实现.
+ */
+static inline u32 
+rb_num_of_entry(struct ringbuf *buffer)
+{
+    return buffer->nr_entry - buffer->nr_read;
+}
+
+static __always_inline void *
+rb_page_index(struct buf_page_meta *bpage, u32 index)
+{
+    return bpage->page->data + index;
+}
+// page 中第一个item的偏移
+static inline u32
+rb_page_start(struct ringbuf *buffer)
+{
+    return buffer->data_start;
+}
+
+static inline 
+u32 rb_page_write(struct buf_page_meta *bpage)
+{
+    return bpage->write;
+}
+
+static __always_inline u32 
+rb_page_commit(struct buf_page_meta *bpage)
+{
+    return bpage->page->commit;
+}
+static __always_inline u32 
+rb_page_size(struct buf_page_meta *bpage)
+{
+    return rb_page_commit(bpage);
+}
+
+// page 是否还没有写入任何item
+static inline int
+rb_page_empty(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    return rb_page_write(bpage) == rb_page_start(buffer);
+}
+
+/*
+ * 在page上写入item前更新page的索引信息.
+ * seq: 第一条从本page开始的记录的序号(对于后续分片, 为下一条记录的序号)
+ */
+static inline void
+rb_page_note(struct ringbuf *buffer, struct buf_page_meta *bpage,
+        u64 seq, u64 ts)
+{
+    if (rb_page_empty(buffer, bpage)) {
+        bpage->seq = seq;
+        bpage->page->time_stamp = ts;
+    }
+    bpage->last_stamp = ts;
+}
+
+// tail_page 剩余的空间能否放下长度为length的item
+static inline int
+rb_page_fits(struct ringbuf *buffer, u32 length)
+{
+    return length + rb_page_write(buffer->tail_page) <= BUF_PAGE_SIZE;
+}
+
+// 在tail_page上为一条完整的记录保留length字节, caller已确认 rb_page_fits()
+static inline void *
+rb_page_claim(struct ringbuf *buffer, u32 length, u32 type, u64 ts)
+{
+    struct buf_page_meta *tail_page = buffer->tail_page;
+    u32 tail = tail_page->write;
+
+    rb_page_note(buffer, tail_page, buffer->nr_entry, ts);
+    tail_page->types |= RB_TYPE_MASK(type);
+    tail_page->write += length;
+    tail_page->nr_entry += 1;
+    return rb_page_index(tail_page, tail);
+}
+
+// 发布tail_page上保留的记录
+static inline void
+rb_page_publish(struct ringbuf *buffer)
+{
+    buffer->nr_entry += 1;
+    buffer->tail_page->page->commit = rb_page_write(buffer->tail_page);
+}
+
+// reader_page 上下一条已提交的记录, NULL代表需要换入新的page(或没有数据)
+static inline void *
+rb_reader_page_peek(struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+
+    if (!rb_num_of_entry(buffer) || reader->read >= rb_page_size(reader))
+        return NULL;
+    return rb_page_index(reader, reader->read);
+}
+
+// reader 在reader_page内前进nr条长度为length的记录
+static inline void
+rb_reader_page_advance(struct ringbuf *buffer, u32 length, u32 nr)
+{
+    buffer->reader_page->read += nr * length;
+    buffer->nr_read += nr;
+}
+
+#ifndef RB_CORE_FAST_PATH
+#define PAGE_SIZE   RB_PAGE_SIZE
 
 
 
@@ -29,11 +144,24 @@
 #define RB_PAGE_MOVED  4UL
 
 
+/* ringbuf_item->frag: 超过一个page的记录被拆分到连续的page中 */
+#define RB_FRAG_NONE   0   // 完整的记录
+#define RB_FRAG_FIRST  1
+#define RB_FRAG_MIDDLE 2
+#define RB_FRAG_LAST   3
+
+
 #ifndef RB_ALLOC_DYNAMIC
-struct ringbuf g_buffer;
+struct ringbuf g_buffer[RB_STATIC_BUFFERS];
 struct buf_page_meta g_bpage[RB_STATIC_PAGES];
-char g_page[RB_STATIC_PAGES][PAGE_SIZE];
+struct buf_page_meta *g_page_index[RB_STATIC_PAGES];
+int g_page_index_idx = 0;
+char g_page[RB_STATIC_PAGES][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+int g_buffer_idx = 0;
 int g_page_idx = 0;
+struct ringbuf_latency g_latency[RB_STATIC_LATENCY];
+u64 g_lat_stamp[RB_STATIC_LATENCY][RB_LAT_SLOTS];
+int g_latency_idx = 0;
 #endif
 
 static struct list_head *
@@ -43,53 +171,168 @@ rb_list_head(struct list_head *list)
     return (struct list_head *)(val & ~RB_FLAG_MASK);
 }
 
+#ifdef RB_DEBUG
 #define rb_debug(args...) printf(args)
+#else
+#define rb_debug(args...) do { } while (0)
+#endif
+
+#ifdef RB_ALLOC_DYNAMIC
+// 分配清零的内存并按cacheline对齐, 用于含 RB_CACHELINE_ALIGNED 成员的结构
+static void *
+rb_zalloc(size_t size)
+{
+    void *p = aligned_alloc(RB_CACHELINE_SIZE, ALIGN_UP(size, RB_CACHELINE_SIZE));
+
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+#endif
+
+/*
+ * RB_USDT: 慢路径上的USDT探针, provider为ringbuf, 参数依次为:
+ *   move_tail   (buffer, old tail_page, new tail_page, old tail_page的commit)
+ *   buffer_full (buffer, tail_page(mirror为0), 需要的长度)
+ *   reader_page (buffer, new reader_page, reader_page的commit, 未读的记录数)
+ *   head_replace(old head_page, new page, 是否成功)
+ *   commit      (buffer, tail_page(mirror为0), commit位置, nr_entry)
+ */
+#ifdef RB_USDT
+#include "sdt.h"
+#define rb_probe3(name, a1, a2, a3)     STAP_PROBE3(ringbuf, name, a1, a2, a3)
+#define rb_probe4(name, a1, a2, a3, a4) STAP_PROBE4(ringbuf, name, a1, a2, a3, a4)
+#else
+#define rb_probe3(name, a1, a2, a3)     do { } while (0)
+#define rb_probe4(name, a1, a2, a3, a4) do { } while (0)
+#endif
 
 ////////////////////////////////////////////
 // ringbuf 基础
 ////////////////////////////////////////////
-static inline u32 
-rb_num_of_entry(struct ringbuf *buffer)
+static inline u64
+rb_clock(struct ringbuf *buffer)
 {
-    return buffer->nr_entry - buffer->nr_read;
+    if (!(buffer->flags & RB_FL_TIMESTAMP))
+        return 0;
+    return buffer->clock();
 }
 
 ////////////////////////////////////////////
 // page 基础
 ////////////////////////////////////////////
-static __always_inline void *
-rb_page_index(struct buf_page_meta *bpage, u32 index)
+static inline void
+rb_inc_page(struct ringbuf *buffer, struct buf_page_meta **bpage)
 {
-    return bpage->page->data + index;
+    struct list_head *p = rb_list_head((*bpage)->list.next);
+    *bpage = list_entry(p, struct buf_page_meta, list);
 }
-static inline 
-u32 rb_page_write(struct buf_page_meta *bpage)
+
+// writer 视角的下一个page: reader_page 之后是 head_page
+static inline struct buf_page_meta *
+rb_tail_next_page(struct ringbuf *buffer, struct buf_page_meta *bpage)
 {
-    return bpage->write;
+    if (bpage == buffer->reader_page)
+        return buffer->head_page;
+    rb_inc_page(buffer, &bpage);
+    return bpage;
+}
+
+// reader 视角的下一个page: 即 rb_get_reader_page() 将要换入的page
+static inline struct buf_page_meta *
+rb_read_next_page(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    return rb_tail_next_page(buffer, bpage);
+}
+
+
+// RB_FL_LAZY: 尚未写入或已释放的page不占用物理内存, 不能访问其内容
+static __always_inline int
+rb_page_resident(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    return !(buffer->flags & RB_FL_LAZY) || bpage->resident;
 }
 
+// 初始化page header, 对 RB_FL_LAZY 而言这是第一次写入page
 static inline void
-rb_inc_page(struct ringbuf *buffer, struct buf_page_meta **bpage)
+rb_page_populate(struct ringbuf *buffer, struct buf_page_meta *bpage)
 {
-    struct list_head *p = rb_list_head((*bpage)->list.next);
-    *bpage = list_entry(p, struct buf_page_meta, list);
+    bpage->resident = 1;
+    bpage->page->commit = rb_page_start(buffer);
 }
 
-static __always_inline u32 
-rb_page_commit(struct buf_page_meta *bpage)
+// 将page恢复为空, 读写位置都指向第一个item
+static void
+rb_reset_page(struct ringbuf *buffer, struct buf_page_meta *bpage)
 {
-    return bpage->page->commit;
+    bpage->write = rb_page_start(buffer);
+    bpage->read = rb_page_start(buffer);
+    bpage->nr_entry = 0;
+    bpage->types = 0;
+    bpage->sample_shift = 0;
+    bpage->sample_first = 0;
+    bpage->dropped = 0;
+    if (rb_page_resident(buffer, bpage))
+        rb_page_populate(buffer, bpage);
 }
-static __always_inline u32 
-rb_page_size(struct buf_page_meta *bpage)
+
+////////////////////////////////////////////
+// sample 相关
+////////////////////////////////////////////
+// 采样级别为shift时type的采样率
+static inline u32
+rb_sample_rate(struct ringbuf *buffer, u32 shift, u32 type)
 {
-    return rb_page_commit(bpage);
+    u32 max = buffer->sampling->max_rate[type];
+
+    if (max <= 1)
+        return 1;
+    return shift >= 31 ? max : MIN(1u << shift, max);
+}
+
+/*
+ * writer移动到新的tail_page后, 按环中已使用的page比例更新采样级别,
+ * 本page上之后的记录都使用这个级别. 只读取reader的head_page一次.
+ * 触发移动的记录在reserve之前就按原来的级别决定了保留, 它落在新page的
+ * 开头, 单独记下这个级别.
+ */
+static void
+rb_sample_update(struct ringbuf *buffer)
+{
+    const struct ringbuf_sampling *smp = buffer->sampling;
+    u32 used, fill;
+
+    buffer->tail_page->sample_first = buffer->sample_shift;
+    used = (buffer->tail_page->index + buffer->nr_page -
+            buffer->head_page->index) % buffer->nr_page + 1;
+    fill = used * 100 / buffer->max_page;
+    buffer->sample_shift = fill < smp->start ? 0 : (fill - smp->start) / smp->step + 1;
+    buffer->tail_page->sample_shift = buffer->sample_shift;
+}
+
+/*
+ * 是否丢弃即将写入的一条type的记录, 在reserve之前调用.
+ * 每rate条记录保留最后1条, 丢弃时不修改buffer的其他状态.
+ */
+static __always_inline int
+rb_sample_skip(struct ringbuf *buffer, u32 type)
+{
+    if (!(buffer->flags & RB_FL_SAMPLE) || !buffer->sample_shift)
+        return 0;
+    if (++buffer->sample_seen[type] <
+            rb_sample_rate(buffer, buffer->sample_shift, type)) {
+        buffer->nr_sampled_out += 1;
+        return 1;
+    }
+    buffer->sample_seen[type] = 0;
+    return 0;
 }
 
 ////////////////////////////////////////////
 // item 相关
 ////////////////////////////////////////////
 #define RB_ITEM_HDR_SIZE (offsetof(struct ringbuf_item, array))
+#define RB_ITEM_TS_SIZE  (sizeof(u32))
 static __always_inline struct ringbuf_item *
 rb_reader_item(struct ringbuf *buffer)
 {
@@ -97,31 +340,341 @@ rb_reader_item(struct ringbuf *buffer)
             buffer->reader_page->read);
 }
 
+// 固定长度记录模式: item 不含header, 只有数据
+static __always_inline int
+rb_fixed(struct ringbuf *buffer)
+{
+    return buffer->record_size != 0;
+}
+
+// 连续的镜像映射数据区, 不使用page
+static __always_inline int
+rb_mirror(struct ringbuf *buffer)
+{
+    return buffer->flags & RB_FL_MIRROR;
+}
+
+// 固定长度记录模式下每条记录占用的空间
+static __always_inline u32
+rb_fixed_space(struct ringbuf *buffer)
+{
+    return ALIGN_UP(buffer->record_size, buffer->align);
+}
+
+// 固定长度记录模式下page中第n条记录, O(1)
+static __always_inline void *
+rb_fixed_index(struct ringbuf *buffer, struct buf_page_meta *bpage, u32 n)
+{
+    return rb_page_index(bpage, rb_page_start(buffer) + n * rb_fixed_space(buffer));
+}
+
+/*
+ * 紧凑header模式(RB_FL_COMPACT), header按字节编码, 不做对齐:
+ * 首字节 type_len = type:5 | len:3
+ * - len 为 1~7: 直接表示数据长度, header只有这一个字节
+ * - len 为 0: 之后紧跟一个varint, 其值为 (数据长度 << 2 | frag)
+ */
+#define RB_COMPACT_INLINE_MAX 7
+
+static __always_inline int
+rb_compact(struct ringbuf *buffer)
+{
+    return buffer->flags & RB_FL_COMPACT;
+}
+
+static inline u32
+rb_varint_len(u32 val)
+{
+    u32 n = 1;
+
+    while (val >= 0x80) {
+        val >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline u32
+rb_compact_hdr_len(u32 len, int frag)
+{
+    if (frag == RB_FRAG_NONE && len <= RB_COMPACT_INLINE_MAX)
+        return 1;
+    return 1 + rb_varint_len(len << 2 | frag);
+}
+
+// 返回header的长度
+static inline u32
+rb_compact_encode(u8 *p, int type, u32 len, int frag)
+{
+    u32 val, n = 1;
+
+    if (frag == RB_FRAG_NONE && len <= RB_COMPACT_INLINE_MAX) {
+        p[0] = type | len << 5;
+        return 1;
+    }
+    p[0] = type;
+    val = len << 2 | frag;
+    while (val >= 0x80) {
+        p[n++] = val | 0x80;
+        val >>= 7;
+    }
+    p[n++] = val;
+    return n;
+}
+
+// 解析后的item header
+struct rb_item_hdr {
+    u32 type;
+    u32 frag;
+    u32 len;   // 数据长度
+    u32 size;  // header本身的长度
+};
+
+static inline void
+rb_compact_decode(const u8 *p, struct rb_item_hdr *hdr)
+{
+    u32 val = 0, shift = 0, n = 1;
+
+    hdr->type = p[0] & 0x1f;
+    hdr->len = p[0] >> 5;
+    hdr->frag = RB_FRAG_NONE;
+    if (!hdr->len) {
+        do {
+            val |= (u32)(p[n] & 0x7f) << shift;
+            shift += 7;
+        } while (p[n++] & 0x80);
+        hdr->len = val >> 2;
+        hdr->frag = val & 3;
+    }
+    hdr->size = n;
+}
+
+// 标准header的item是否带有时间戳增量
+static __always_inline int
+rb_item_ts(struct ringbuf *buffer)
+{
+    return (buffer->flags & RB_FL_TIMESTAMP) &&
+        !rb_fixed(buffer) && !rb_compact(buffer);
+}
+
+// 标准header的长度, 含时间戳增量
+static __always_inline u32
+rb_item_hdr_size(struct ringbuf *buffer)
+{
+    return RB_ITEM_HDR_SIZE + (rb_item_ts(buffer) ? RB_ITEM_TS_SIZE : 0);
+}
+
+// RB_FL_ISOLATE: 下一条记录的header单独占用一个cacheline
+static inline int
+rb_item_isolated(struct ringbuf *buffer)
+{
+    return buffer->flags & RB_FL_ISOLATE;
+}
+
+// 数据长度为length的item在page中实际占用的空间
+// item的数据区总是按 buffer->align 对齐, header紧挨在数据区之前
+static inline u32
+rb_item_space(struct ringbuf *buffer, u32 length)
+{
+    if (rb_fixed(buffer))
+        return rb_fixed_space(buffer);
+    if (rb_compact(buffer))
+        return rb_compact_hdr_len(length, RB_FRAG_NONE) + length;
+    if (rb_item_isolated(buffer))
+        return ALIGN_UP(length, buffer->align) + buffer->align;
+    return ALIGN_UP(length + rb_item_hdr_size(buffer), buffer->align);
+}
+
+// 长度为space的空间中最多能放下多长的数据, 对紧凑header按分片估算
+static inline u32
+rb_item_max_data(struct ringbuf *buffer, u32 space)
+{
+    if (rb_fixed(buffer))
+        return buffer->record_size;
+    if (rb_compact(buffer))
+        return space - rb_compact_hdr_len(space, RB_FRAG_LAST);
+    if (rb_item_isolated(buffer))
+        return ALIGN_DOWN(space, buffer->align) - buffer->align;
+    return ALIGN_DOWN(space, buffer->align) - rb_item_hdr_size(buffer);
+}
+// RB_FL_MIRROR: 一条记录最多占满整个数据区, 同时受header中len的位数限制
+static inline u32
+rb_mirror_max_data(struct ringbuf *buffer)
+{
+    return MIN(rb_item_max_data(buffer, buffer->mirror_size), (1u << 24) - 1);
+}
+#define RB_ITEM_MAX_DATA(buffer) \
+    (rb_mirror(buffer) ? rb_mirror_max_data(buffer) : \
+     rb_item_max_data(buffer, BUF_PAGE_SIZE - rb_page_start(buffer)))
+
+// len: 数据长度, 不含header及对齐的padding
 static inline void
-rb_init_item(struct ringbuf_item *item, int type, u32 len)
+rb_init_item(struct ringbuf_item *item, int type, u32 len, int frag)
 {
     item->type = type;
-    item->len = len-RB_ITEM_HDR_SIZE;
+    item->frag = frag;
+    item->ts = 0;
+    item->len = len;
+}
+
+// 按buffer的记录格式写入item header
+// delta: item时间戳相对于所在page时间戳的增量
+static inline void
+rb_write_item_hdr(struct ringbuf *buffer, struct ringbuf_item *item,
+        int type, u32 len, int frag, u32 delta)
+{
+    if (rb_compact(buffer)) {
+        rb_compact_encode((u8 *)item, type, len, frag);
+        return;
+    }
+    rb_init_item(item, type, len, frag);
+    if (rb_item_ts(buffer)) {
+        item->ts = 1;
+        memcpy(item->array, &delta, RB_ITEM_TS_SIZE);
+    }
 }
 
 static __always_inline void *
 rb_item_data(struct ringbuf_item *item)
 {
-    return &item->array[0];
+    return &item->array[item->ts ? RB_ITEM_TS_SIZE : 0];
+}
+
+static inline u32
+rb_item_delta(struct ringbuf_item *item)
+{
+    u32 delta = 0;
+
+    if (item->ts)
+        memcpy(&delta, item->array, RB_ITEM_TS_SIZE);
+    return delta;
 }
 
 static inline u32
 rb_item_data_length(struct ringbuf_item *item)
 {
-    return item->len + RB_ITEM_HDR_SIZE;
+    return item->len;
 }
+// item 在page中占用的长度(含header及padding)
 static inline u32
-rb_item_length(struct ringbuf_item *item)
+rb_item_length(struct ringbuf *buffer, struct ringbuf_item *item)
 {
+    struct rb_item_hdr hdr;
+
+    // 固定长度记录无需解析header
+    if (rb_fixed(buffer))
+        return rb_fixed_space(buffer);
+    if (rb_compact(buffer)) {
+        rb_compact_decode((u8 *)item, &hdr);
+        return hdr.size + hdr.len;
+    }
     // ONLY RINGBUG_TYPE_DATA
+    return rb_item_space(buffer, rb_item_data_length(item));
+}
+
+static inline int
+rb_item_frag(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    struct rb_item_hdr hdr;
+
+    if (rb_fixed(buffer))
+        return RB_FRAG_NONE;
+    if (rb_compact(buffer)) {
+        rb_compact_decode((u8 *)item, &hdr);
+        return hdr.frag;
+    }
+    return item->frag;
+}
+
+// 该item之后是否还有属于同一条记录的分片
+static inline int
+rb_item_has_next_frag(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    int frag = rb_item_frag(buffer, item);
+
+    return frag == RB_FRAG_FIRST || frag == RB_FRAG_MIDDLE;
+}
+
+// 该item是否为前一条记录的后续分片
+static inline int
+rb_item_is_cont(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    int frag = rb_item_frag(buffer, item);
+
+    return frag == RB_FRAG_MIDDLE || frag == RB_FRAG_LAST;
+}
+
+/*
+ * 以下接口根据buffer的记录格式解析item, 
+ * 固定长度记录模式下item直接指向数据.
+ */
+static inline void *
+rb_entry_data(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    struct rb_item_hdr hdr;
+
+    if (rb_fixed(buffer))
+        return item;
+    if (rb_compact(buffer)) {
+        rb_compact_decode((u8 *)item, &hdr);
+        return (u8 *)item + hdr.size;
+    }
+    return rb_item_data(item);
+}
+
+static inline u32
+rb_entry_length(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    struct rb_item_hdr hdr;
+
+    if (rb_fixed(buffer))
+        return buffer->record_size;
+    if (rb_compact(buffer)) {
+        rb_compact_decode((u8 *)item, &hdr);
+        return hdr.len;
+    }
     return rb_item_data_length(item);
 }
 
+static inline u32
+rb_entry_type(struct ringbuf *buffer, struct ringbuf_item *item)
+{
+    if (rb_fixed(buffer))
+        return 0;
+    if (rb_compact(buffer))
+        return *(u8 *)item & 0x1f;
+    return item->type;
+}
+
+static inline void
+rb_item_to_entry(struct ringbuf *buffer, struct buf_page_meta *bpage,
+        struct ringbuf_item *item, struct ringbuf_entry *entry)
+{
+    u32 shift;
+
+    entry->data = rb_entry_data(buffer, item);
+    entry->len = rb_entry_length(buffer, item);
+    entry->type = rb_entry_type(buffer, item);
+    // RB_FL_MIRROR 没有page, 也没有时间戳
+    entry->page = bpage;
+    entry->ts = bpage ? bpage->page->time_stamp : 0;
+    if (rb_item_ts(buffer))
+        entry->ts += rb_item_delta(item);
+    entry->rate = 1;
+    if (buffer->flags & RB_FL_SAMPLE) {
+        shift = (u8 *)item - bpage->page->data == rb_page_start(buffer) ?
+            bpage->sample_first : bpage->sample_shift;
+        entry->rate = rb_sample_rate(buffer, shift, entry->type);
+    }
+}
+
+// 使用 ringbuf_item 作为header的标准格式
+static __always_inline int
+rb_std_hdr(struct ringbuf *buffer)
+{
+    return !rb_fixed(buffer) && !rb_compact(buffer);
+}
+
 ////////////////////////////////////////////
 // head_page 相关
 ////////////////////////////////////////////
@@ -171,6 +724,7 @@ rb_head_page_replace(struct buf_page_meta *old, struct buf_page_meta *new)
     val |= RB_PAGE_HEAD;
 
     ret = cmpxchg(ptr, val, (unsigned long)&new->list);
+    rb_probe3(head_replace, old, new, ret == val);
     return ret == val;
 }
 
@@ -188,14 +742,961 @@ rb_head_page_activate(struct ringbuf *buffer)
 static void
 rb_head_page_deactivate(struct ringbuf *buffer)
 {
-    rb_list_head_clear(buffer->head_page->list.prev);
+    rb_list_head_clear(buffer->head_page->list.prev);
+}
+
+    
+
+////////////////////////////////////////////
+// crc 相关
+////////////////////////////////////////////
+#define RB_CRC32C_POLY 0x82f63b78u  // Castagnoli, bit-reflected
+
+static u32 rb_crc32c_table[256];
+
+static u32
+rb_crc32c_sw(u32 crc, const u8 *p, u32 len)
+{
+    while (len--)
+        crc = rb_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static u32
+rb_crc32c_hw(u32 crc, const u8 *p, u32 len)
+{
+    u64 c = crc, v;
+
+    for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (u32)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+// 3条独立的crc32指令链交错执行, 吞吐约为单条链的3倍
+__attribute__((target("sse4.2"))) static void
+rb_crc32c_hw_x3(u32 crc[3], const u8 *p, u32 lane)
+{
+    u64 c0 = crc[0], c1 = crc[1], c2 = crc[2], v0, v1, v2;
+
+    for (u32 i = 0; i < lane; i += sizeof(u64)) {
+        memcpy(&v0, p + i, sizeof(u64));
+        memcpy(&v1, p + lane + i, sizeof(u64));
+        memcpy(&v2, p + 2 * lane + i, sizeof(u64));
+        c0 = _mm_crc32_u64(c0, v0);
+        c1 = _mm_crc32_u64(c1, v1);
+        c2 = _mm_crc32_u64(c2, v2);
+    }
+    crc[0] = (u32)c0;
+    crc[1] = (u32)c1;
+    crc[2] = (u32)c2;
+}
+#endif
+
+static void
+rb_crc32c_sw_x3(u32 crc[3], const u8 *p, u32 lane)
+{
+    for (int k = 0; k < 3; k++)
+        crc[k] = rb_crc32c_sw(crc[k], p + k * lane, lane);
+}
+
+static u32 (*rb_crc32c)(u32 crc, const u8 *p, u32 len) = rb_crc32c_sw;
+static void (*rb_crc32c_x3)(u32 crc[3], const u8 *p, u32 lane) = rb_crc32c_sw_x3;
+
+static void
+rb_crc32c_init(void)
+{
+    u32 crc;
+
+    for (u32 i = 0; i < 256; i++) {
+        crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (crc & 1 ? RB_CRC32C_POLY : 0);
+        rb_crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        rb_crc32c = rb_crc32c_hw;
+        rb_crc32c_x3 = rb_crc32c_hw_x3;
+    }
+#endif
+}
+
+/*
+ * 覆盖page header中除crc外的成员, 以及commit之前的数据.
+ * 数据按8字节对齐分为3段分别计算CRC32C(最后一段含不足对齐的尾部),
+ * 结果再与header一起计算一次CRC32C.
+ */
+static u32
+rb_page_crc(struct buf_page *page)
+{
+    u32 len = MIN(page->commit, BUF_PAGE_SIZE);
+    u32 lane = ALIGN_DOWN(len / 3, sizeof(u64));
+    u32 c[3] = { ~0u, ~0u, ~0u };
+    u32 crc = ~0u;
+
+    rb_crc32c_x3(c, page->data, lane);
+    c[2] = rb_crc32c(c[2], page->data + 3 * lane, len - 3 * lane);
+
+    crc = rb_crc32c(crc, (const u8 *)&page->time_stamp, sizeof(page->time_stamp));
+    crc = rb_crc32c(crc, (const u8 *)&page->commit, sizeof(page->commit));
+    crc = rb_crc32c(crc, (const u8 *)c, sizeof(c));
+    return ~crc;
+}
+
+// writer离开page时调用
+static inline void
+rb_page_seal(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    if (buffer->flags & RB_FL_CRC)
+        bpage->page->crc = rb_page_crc(bpage->page);
+}
+
+// writer仍在写入的tail_page尚未计算crc, 不做校验
+static inline int
+rb_page_crc_ok(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    if (!(buffer->flags & RB_FL_CRC) || bpage == buffer->tail_page)
+        return 1;
+    return bpage->page->crc == rb_page_crc(bpage->page);
+}
+
+////////////////////////////////////////////
+// copy 相关
+////////////////////////////////////////////
+#if defined(__x86_64__)
+/*
+ * 绕过cache写入: 数据要等到另一个核上的reader才会被读取, 写入时不需要
+ * 把ring的cacheline拉进writer的cache, 也就不会挤出writer自己的工作集.
+ * 先用普通store写到dst按向量长度对齐, 剩余不足64字节的尾部同样使用普通store.
+ */
+static void
+rb_copy_nt_sse2(void *dst, const void *src, u32 len)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    u32 head = -(uintptr_t)d & 15;
+    __m128i a, b, c, e;
+
+    memcpy(d, s, head);
+    d += head, s += head, len -= head;
+    for (; len >= 64; d += 64, s += 64, len -= 64) {
+        a = _mm_loadu_si128((const __m128i *)s);
+        b = _mm_loadu_si128((const __m128i *)(s + 16));
+        c = _mm_loadu_si128((const __m128i *)(s + 32));
+        e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx"))) static void
+rb_copy_nt_avx(void *dst, const void *src, u32 len)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    u32 head = -(uintptr_t)d & 31;
+    __m256i a, b;
+
+    memcpy(d, s, head);
+    d += head, s += head, len -= head;
+    for (; len >= 64; d += 64, s += 64, len -= 64) {
+        a = _mm256_loadu_si256((const __m256i *)s);
+        b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+    }
+    memcpy(d, s, len);
+}
+
+static void (*rb_copy_nt)(void *dst, const void *src, u32 len) = rb_copy_nt_sse2;
+#endif
+
+static void
+rb_copy_init(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx"))
+        rb_copy_nt = rb_copy_nt_avx;
+#endif
+}
+
+/*
+ * 写入记录的数据: 常见的小长度展开为定长拷贝. RB_FL_NT_COPY 时不短于
+ * RB_NT_COPY_MIN 的数据使用non-temporal store, 并在返回(即commit)之前sfence,
+ * 保证reader看到commit时数据已经可见.
+ */
+static __always_inline void
+rb_copy_data(struct ringbuf *buffer, void *dst, const void *src, u32 len)
+{
+    switch (len) {
+    case 1:  memcpy(dst, src, 1);  return;
+    case 2:  memcpy(dst, src, 2);  return;
+    case 4:  memcpy(dst, src, 4);  return;
+    case 8:  memcpy(dst, src, 8);  return;
+    case 16: memcpy(dst, src, 16); return;
+    case 32: memcpy(dst, src, 32); return;
+    }
+#if defined(__x86_64__)
+    if ((buffer->flags & RB_FL_NT_COPY) && len >= RB_NT_COPY_MIN) {
+        rb_copy_nt(dst, src, len);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memcpy(dst, src, len);
+}
+
+////////////////////////////////////////////
+// pool 相关
+////////////////////////////////////////////
+// 从pool的空闲栈中取出一个page, pool为空时返回NULL. lock-free
+static struct buf_page_meta *
+rb_pool_get(struct ringbuf_pool *pool)
+{
+    struct buf_page_meta *bpage;
+    u64 old, new;
+    u32 next;
+
+    old = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+    do {
+        if (!(u32)old)
+            return NULL;
+        // 读到的next可能已被其他线程修改, 此时版本号变化, CAS会失败
+        bpage = &pool->pages[(u32)old - 1];
+        next = __atomic_load_n(&bpage->index, __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&pool->free, &old, new, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    __atomic_sub_fetch(&pool->nr_free, 1, __ATOMIC_RELAXED);
+    return bpage;
+}
+
+// 将page放回pool的空闲栈. lock-free
+static void
+rb_pool_put(struct buf_page_meta *bpage)
+{
+    struct ringbuf_pool *pool = bpage->pool;
+    u32 idx = bpage - pool->pages + 1;
+    u64 old, new;
+
+    old = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&bpage->index, (u32)old, __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | idx;
+    } while (!__atomic_compare_exchange_n(&pool->free, &old, new, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&pool->nr_free, 1, __ATOMIC_RELAXED);
+}
+
+// 从head_page开始按环中的顺序为各page编号
+static void
+rb_number_pages(struct ringbuf *buffer)
+{
+    struct list_head *first = &buffer->head_page->list;
+    struct list_head *p = first;
+    struct buf_page_meta *bpage;
+    u32 i = 0;
+
+    do {
+        bpage = list_entry(p, struct buf_page_meta, list);
+        bpage->index = i;
+        buffer->page_index[i++] = bpage;
+        p = rb_list_head(p->next);
+    } while (p != first);
+    assert(i == buffer->nr_page);
+}
+
+/*
+ * 从pool借用最多nr个空page, 插入环中head_page之前, 即紧跟在writer
+ * 可用的空page之后. 受 buffer->max_page 限制, 返回实际借到的page数.
+ * 需持有buffer的锁.
+ */
+static u32
+rb_pool_grow(struct ringbuf *buffer, u32 nr)
+{
+    struct buf_page_meta *head = buffer->head_page;
+    struct buf_page_meta *bpage;
+    u32 i;
+
+    if (!buffer->pool)
+        return 0;
+    for (i = 0; i < nr && buffer->nr_page < buffer->max_page; i++) {
+        bpage = rb_pool_get(buffer->pool);
+        if (!bpage)
+            break;
+        rb_reset_page(buffer, bpage);
+        bpage->list.prev = head->list.prev;
+        bpage->list.next = &head->list;
+        rb_set_list_to_head(&bpage->list);
+        rb_head_page_replace(head, bpage);
+        head->list.prev = &bpage->list;
+        buffer->nr_page += 1;
+        rb_debug("[pool] borrow page <%p>\n", bpage);
+    }
+    if (i)
+        rb_number_pages(buffer);
+    return i;
+}
+
+// page上还有 ringbuf_consume_hold() 返回的记录没有释放, 可能由其他线程释放
+static __always_inline int
+rb_page_held(struct buf_page_meta *bpage)
+{
+    return __atomic_load_n(&bpage->hold, __ATOMIC_ACQUIRE) != 0;
+}
+
+// 读完的reader_page借自pool, 且环中还有借来的page时直接归还.
+// 仍被持有的page放回环中, 释放后由writer重新使用
+static inline int
+rb_pool_shrinkable(struct ringbuf *buffer)
+{
+    return buffer->reader_page->pool &&
+        buffer->nr_page > buffer->min_page &&
+        !rb_page_held(buffer->reader_page);
+}
+
+/*
+ * 与 rb_swap_reader_page() 相同, 将head_page换成新的reader_page,
+ * 但旧的reader_page不放回环中而是归还pool, 环因此缩小一个page.
+ */
+static struct buf_page_meta *
+rb_pool_shrink(struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader = buffer->head_page;
+    struct list_head *prev = reader->list.prev;
+    struct list_head *next = rb_list_head(reader->list.next);
+
+    prev->next = next;
+    rb_set_list_to_head(prev);
+    next->prev = prev;
+    rb_inc_page(buffer, &buffer->head_page);
+    buffer->nr_page -= 1;
+    rb_number_pages(buffer);
+
+    rb_debug("[pool] return page <%p>\n", buffer->reader_page);
+    rb_pool_put(buffer->reader_page);
+    buffer->reader_page = reader;
+    reader->read = rb_page_start(buffer);
+    return reader;
+}
+
+////////////////////////////////////////////
+// latency 相关
+////////////////////////////////////////////
+// 延迟value所在的桶, 参考 struct ringbuf_latency
+static inline u32
+rb_lat_bucket(u64 value)
+{
+    u32 msb;
+
+    if (value < (1u << RB_LAT_SUB_BITS))
+        return value;
+    msb = 63 - __builtin_clzll(value);
+    return ((msb - RB_LAT_SUB_BITS + 1) << RB_LAT_SUB_BITS) +
+        ((value >> (msb - RB_LAT_SUB_BITS)) & ((1u << RB_LAT_SUB_BITS) - 1));
+}
+
+// 桶中的最小值
+static inline u64
+rb_lat_bucket_min(u32 bucket)
+{
+    u32 sub = bucket & ((1u << RB_LAT_SUB_BITS) - 1);
+    u32 shift = bucket >> RB_LAT_SUB_BITS;
+
+    if (!shift)
+        return bucket;
+    return (u64)((1u << RB_LAT_SUB_BITS) + sub) << (shift - 1);
+}
+
+static void
+rb_alloc_latency(struct ringbuf *buffer)
+{
+#ifdef RB_ALLOC_DYNAMIC
+    buffer->lat = calloc(1, sizeof(*buffer->lat));
+    buffer->lat_stamp = calloc(RB_LAT_SLOTS, sizeof(*buffer->lat_stamp));
+    if (!buffer->lat || !buffer->lat_stamp)
+        assert(0);
+#else
+    assert(g_latency_idx < RB_STATIC_LATENCY);
+    buffer->lat = &g_latency[g_latency_idx];
+    buffer->lat_stamp = g_lat_stamp[g_latency_idx++];
+#endif
+}
+
+/*
+ * writer在第nr_entry条记录commit(发布)之前记录commit时间.
+ * release与 rb_lat_consume() 的acquire配对: reader读到这个时间时,
+ * 一定也能看到之前各条记录commit后递增的nr_entry.
+ */
+static __always_inline void
+rb_lat_commit(struct ringbuf *buffer)
+{
+    __atomic_store_n(&buffer->lat_stamp[buffer->nr_entry & (RB_LAT_SLOTS - 1)],
+            buffer->clock(), __ATOMIC_RELEASE);
+}
+
+// reader在now消费第seq条记录, 将它从commit起等待的时间计入直方图
+static void
+rb_lat_consume(struct ringbuf *buffer, u64 seq, u64 now)
+{
+    struct ringbuf_latency *lat = buffer->lat;
+    u64 stamp, age, max;
+
+    stamp = __atomic_load_n(&buffer->lat_stamp[seq & (RB_LAT_SLOTS - 1)],
+            __ATOMIC_ACQUIRE);
+    // 第seq+RB_LAT_SLOTS条记录已开始commit, 读到的时间可能已被它覆盖
+    if (__atomic_load_n(&buffer->nr_entry, __ATOMIC_RELAXED) - seq >= RB_LAT_SLOTS) {
+        __atomic_fetch_add(&lat->missed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    age = now > stamp ? now - stamp : 0;
+    // ringbuf_latency_read() 可能同时在其他线程清零, 都使用原子操作
+    __atomic_fetch_add(&lat->count[rb_lat_bucket(age)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lat->sum, age, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&lat->max, __ATOMIC_RELAXED);
+    while (age > max && !__atomic_compare_exchange_n(&lat->max, &max, age,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+////////////////////////////////////////////
+// mirror 相关
+////////////////////////////////////////////
+// 位置pos处的item. 越过数据区末尾的部分落在第二个映射中, 地址仍然连续
+static __always_inline struct ringbuf_item *
+rb_mirror_item(struct ringbuf *buffer, u64 pos)
+{
+    return (struct ringbuf_item *)(buffer->mirror + pos % buffer->mirror_size);
+}
+
+/*
+ * 保留长度为length的空间(含header), 空间不足时返回NULL.
+ * 只有writer修改mirror_tail, reader释放的空间由mirror_free得知.
+ */
+static inline struct ringbuf_item *
+rb_mirror_reserve(struct ringbuf *buffer, u32 length)
+{
+    u64 head = __atomic_load_n(&buffer->mirror_free, __ATOMIC_ACQUIRE);
+    u64 tail = buffer->mirror_tail;
+
+    if (tail + length - head > buffer->mirror_size) {
+        rb_probe3(buffer_full, buffer, 0, length);
+        return NULL;
+    }
+    buffer->mirror_tail = tail + length;
+    return rb_mirror_item(buffer, tail);
+}
+
+// 发布mirror_tail之前保留的记录
+static __always_inline void
+rb_mirror_commit(struct ringbuf *buffer)
+{
+    __atomic_store_n(&buffer->mirror_commit, buffer->mirror_tail,
+            __ATOMIC_RELEASE);
+}
+
+/*
+ * 上一条被消费的记录在下一次读取时才释放给writer, 因此与page模式一样,
+ * ringbuf_consume() 返回的记录在下一次调用前保持有效.
+ */
+static inline struct ringbuf_item *
+rb_mirror_peek(struct ringbuf *buffer)
+{
+    if (buffer->mirror_free != buffer->mirror_head)
+        __atomic_store_n(&buffer->mirror_free, buffer->mirror_head,
+                __ATOMIC_RELEASE);
+    if (buffer->mirror_head ==
+            __atomic_load_n(&buffer->mirror_commit, __ATOMIC_ACQUIRE))
+        return NULL;
+    return rb_mirror_item(buffer, buffer->mirror_head);
+}
+
+// 消费mirror_head处的记录
+static inline void
+rb_mirror_advance(struct ringbuf *buffer)
+{
+    struct ringbuf_item *item = rb_mirror_item(buffer, buffer->mirror_head);
+
+    buffer->mirror_head += rb_item_length(buffer, item);
+    if (buffer->flags & RB_FL_LATENCY)
+        rb_lat_consume(buffer, buffer->nr_read, buffer->clock());
+    buffer->nr_read += 1;
+}
+
+////////////////////////////////////////////
+// lazy 相关
+////////////////////////////////////////////
+/*
+ * 释放writer前方读完后空闲超过 RB_LAZY_IDLE_NS 的page的物理内存.
+ * tail_page之后直到第一个有数据的page(即head_page)都是空page,
+ * 其中越靠近tail_page的越早被读完. 返回释放的page数.
+ */
+static u32
+rb_lazy_release(struct ringbuf *buffer, u64 now)
+{
+    struct buf_page_meta *bpage = buffer->tail_page;
+    u32 nr = 0;
+
+    buffer->lazy_check = now;
+    for (u32 i = 0; i < buffer->nr_page; i++) {
+        bpage = rb_tail_next_page(buffer, bpage);
+        if (bpage == buffer->tail_page)
+            break;
+        if (!bpage->resident || rb_page_held(bpage))
+            continue;
+        if (rb_page_commit(bpage) > rb_page_start(buffer))
+            break;
+        if (now - bpage->drained < RB_LAZY_IDLE_NS)
+            continue;
+        if (madvise(bpage->page, PAGE_SIZE, MADV_DONTNEED))
+            break;
+        bpage->resident = 0;
+        nr++;
+    }
+    rb_debug("[lazy] released %u pages\n", nr);
+    return nr;
+}
+
+////////////////////////////////////////////
+// history 相关
+////////////////////////////////////////////
+/*
+ * 自带的LZ压缩, 格式与LZ4 block相同: 每个序列以1字节token开始, 高4位为
+ * 字面量长度, 低4位为匹配长度减4, 取15时后面跟随若干字节(255代表继续)
+ * 累加; 之后是字面量, 再之后是2字节(小端)的匹配距离. 最后一个序列只有
+ * 字面量. page不超过64K, 用u16保存位置的哈希表即可.
+ */
+#define RB_LZ_MIN_MATCH 4
+#define RB_LZ_HASH_BITS 12
+
+static inline u32
+rb_lz_read32(const u8 *p)
+{
+    u32 val;
+
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline u32
+rb_lz_hash(u32 val)
+{
+    return (val * 2654435761u) >> (32 - RB_LZ_HASH_BITS);
+}
+
+// 写入token之后的长度扩展字节
+static inline u8 *
+rb_lz_put_len(u8 *op, u32 len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/*
+ * 压缩src中len字节到dst, 返回压缩后的长度.
+ * 结果超过cap(即压缩不划算)时返回0.
+ */
+static u32
+rb_lz_compress(const u8 *src, u32 len, u8 *dst, u32 cap)
+{
+    uint16_t table[1u << RB_LZ_HASH_BITS] = { 0 };
+    u32 ip = 0, anchor = 0, ref, lit, mlen, h;
+    u8 *op = dst, *end = dst + cap, *token;
+
+    while (ip + RB_LZ_MIN_MATCH <= len) {
+        h = rb_lz_hash(rb_lz_read32(src + ip));
+        ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || rb_lz_read32(src + ref) != rb_lz_read32(src + ip)) {
+            // 连续找不到匹配时加大步长, 不可压缩的数据很快结束
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        mlen = RB_LZ_MIN_MATCH;
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+
+        lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > end)
+            return 0;
+        token = op++;
+        *token = (MIN(lit, 15u) << 4) | MIN(mlen - RB_LZ_MIN_MATCH, 15u);
+        if (lit >= 15)
+            op = rb_lz_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen - RB_LZ_MIN_MATCH >= 15)
+            op = rb_lz_put_len(op, mlen - RB_LZ_MIN_MATCH - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    lit = len - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > end)
+        return 0;
+    token = op++;
+    *token = MIN(lit, 15u) << 4;
+    if (lit >= 15)
+        op = rb_lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    return op + lit - dst;
+}
+
+// 读取token之后的长度扩展字节
+static inline const u8 *
+rb_lz_get_len(const u8 *ip, const u8 *end, u32 *len)
+{
+    u8 b;
+
+    do {
+        if (ip >= end)
+            return NULL;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+/*
+ * 解压src中len字节到dst, 返回解压后的长度.
+ * 数据损坏(越界)时返回-1.
+ */
+static int
+rb_lz_decompress(const u8 *src, u32 len, u8 *dst, u32 cap)
+{
+    const u8 *ip = src, *end = src + len;
+    u8 *op = dst;
+    u32 lit, mlen, off;
+    u8 token;
+
+    while (ip < end) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && !(ip = rb_lz_get_len(ip, end, &lit)))
+            return -1;
+        if (lit > (u32)(end - ip) || lit > cap - (u32)(op - dst))
+            return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        // 最后一个序列没有匹配
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15 && !(ip = rb_lz_get_len(ip, end, &mlen)))
+            return -1;
+        mlen += RB_LZ_MIN_MATCH;
+        if (!off || off > (u32)(op - dst) || mlen > cap - (u32)(op - dst))
+            return -1;
+        // 匹配可能与输出重叠, 逐字节拷贝
+        for (u32 i = 0; i < mlen; i++, op++)
+            *op = *(op - off);
+    }
+    return op - dst;
+}
+
+/*
+ * history中的一个block: 一个读完的page压缩后的数据, 及迭代时需要的page信息.
+ * block按 RB_HIST_ALIGN 对齐且不跨越history的末尾, 末尾放不下时填充一个
+ * size为 RB_HIST_PAD 的header, 下一个block从history的开头开始.
+ */
+struct rb_hist_block {
+    u32 size;        // 压缩后的长度, 等于commit代表压缩不划算, 原样保存
+    u32 commit;      // page的commit, 即解压后的长度
+    u32 nr_entry;
+    u32 types;
+    u32 sample_shift;
+    u32 sample_first;
+    u64 seq;
+    u64 time_stamp;
+    u64 last_stamp;
+    u8 data[];
+};
+#define RB_HIST_ALIGN 8u
+#define RB_HIST_PAD   ((u32)-1)
+
+static void
+rb_alloc_history(struct ringbuf *buffer, u32 size)
+{
+    // 一个block最多占用一个page, 写入时还可能需要填充history的末尾.
+    // 匹配距离只有2字节
+    assert(size >= 2 * PAGE_SIZE && PAGE_SIZE <= 0x10000);
+    buffer->hist_size = ALIGN_UP(size, RB_HIST_ALIGN);
+#ifdef RB_ALLOC_DYNAMIC
+    buffer->hist = malloc(buffer->hist_size);
+    buffer->hist_scratch = malloc(PAGE_SIZE);
+    buffer->hist_page = rb_zalloc(sizeof(*buffer->hist_page));
+    if (!buffer->hist || !buffer->hist_scratch || !buffer->hist_page)
+        assert(0);
+    buffer->hist_page->page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (!buffer->hist_page->page)
+        assert(0);
+#else
+    // 使用连续的静态page作为history区
+    u32 nr = DIV_ROUND_UP(buffer->hist_size, PAGE_SIZE);
+
+    assert(g_page_idx + 2 + nr <= RB_STATIC_PAGES);
+    buffer->hist_page = &g_bpage[g_page_idx];
+    buffer->hist_page->page = (struct buf_page *)&g_page[g_page_idx];
+    buffer->hist_scratch = (u8 *)&g_page[g_page_idx + 1];
+    buffer->hist = (u8 *)&g_page[g_page_idx + 2];
+    g_page_idx += 2 + nr;
+#endif
+    buffer->hist_page->index = (u32)-1;
+}
+
+static inline struct rb_hist_block *
+rb_hist_block(struct ringbuf *buffer, u64 pos)
+{
+    return (struct rb_hist_block *)(buffer->hist + pos % buffer->hist_size);
+}
+
+// pos处block之后的位置
+static inline u64
+rb_hist_next(struct ringbuf *buffer, u64 pos)
+{
+    struct rb_hist_block *blk = rb_hist_block(buffer, pos);
+
+    if (blk->size == RB_HIST_PAD)
+        return pos + buffer->hist_size - pos % buffer->hist_size;
+    return pos + ALIGN_UP(sizeof(*blk) + blk->size, RB_HIST_ALIGN);
+}
+
+// 丢弃最旧的block, 直到history可以容纳到end为止
+static void
+rb_hist_evict(struct ringbuf *buffer, u64 end)
+{
+    struct rb_hist_block *blk;
+
+    while (end - buffer->hist_head > buffer->hist_size) {
+        blk = rb_hist_block(buffer, buffer->hist_head);
+        if (blk->size != RB_HIST_PAD) {
+            buffer->nr_hist -= 1;
+            buffer->hist_raw -= blk->commit;
+        }
+        buffer->hist_head = rb_hist_next(buffer, buffer->hist_head);
+    }
+}
+
+/*
+ * reader读完bpage后将其压缩保存到history. 只含后续分片的page不保存,
+ * 迭代器本来就会跳过这些分片.
+ */
+static void
+rb_hist_save(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    struct rb_hist_block *blk;
+    u32 raw = rb_page_commit(bpage);
+    const u8 *data = buffer->hist_scratch;
+    u32 size, need, off;
+
+    if (!bpage->nr_entry || bpage->dropped)
+        return;
+    // 先压缩到临时空间, 知道长度后再在history中腾出空间.
+    // 不使用hist_page, 迭代器可能正在读取其中解压出的记录
+    size = rb_lz_compress(bpage->page->data, raw, buffer->hist_scratch, raw - 1);
+    if (!size) {
+        data = bpage->page->data;
+        size = raw;
+    }
+
+    need = ALIGN_UP(sizeof(*blk) + size, RB_HIST_ALIGN);
+    off = buffer->hist_tail % buffer->hist_size;
+    if (off + need > buffer->hist_size) {
+        rb_hist_evict(buffer, buffer->hist_tail + buffer->hist_size - off);
+        rb_hist_block(buffer, buffer->hist_tail)->size = RB_HIST_PAD;
+        buffer->hist_tail += buffer->hist_size - off;
+    }
+    rb_hist_evict(buffer, buffer->hist_tail + need);
+
+    blk = rb_hist_block(buffer, buffer->hist_tail);
+    blk->size = size;
+    blk->commit = raw;
+    blk->nr_entry = bpage->nr_entry;
+    blk->types = bpage->types;
+    blk->sample_shift = bpage->sample_shift;
+    blk->sample_first = bpage->sample_first;
+    blk->seq = bpage->seq;
+    blk->time_stamp = bpage->page->time_stamp;
+    blk->last_stamp = bpage->last_stamp;
+    memcpy(blk->data, data, size);
+    buffer->hist_tail += need;
+    buffer->nr_hist += 1;
+    buffer->hist_raw += raw;
+    rb_debug("[hist] page <%p> %u -> %u bytes\n", bpage, raw, size);
+}
+
+// 将pos处的block解压到 hist_page
+static void
+rb_hist_load(struct ringbuf *buffer, u64 pos)
+{
+    struct rb_hist_block *blk = rb_hist_block(buffer, pos);
+    struct buf_page_meta *bpage = buffer->hist_page;
+
+    if (blk->size == blk->commit)
+        memcpy(bpage->page->data, blk->data, blk->commit);
+    else if (rb_lz_decompress(blk->data, blk->size, bpage->page->data,
+                BUF_PAGE_SIZE) != (int)blk->commit)
+        assert(0);
+    bpage->page->commit = blk->commit;
+    bpage->page->time_stamp = blk->time_stamp;
+    bpage->nr_entry = blk->nr_entry;
+    bpage->types = blk->types;
+    bpage->sample_shift = blk->sample_shift;
+    bpage->sample_first = blk->sample_first;
+    bpage->seq = blk->seq;
+    bpage->last_stamp = blk->last_stamp;
+}
+
+// 清空history
+static inline void
+rb_hist_reset(struct ringbuf *buffer)
+{
+    buffer->hist_head = buffer->hist_tail;
+    buffer->nr_hist = 0;
+    buffer->hist_raw = 0;
+}
+
+////////////////////////////////////////////
+// reader_page 相关
+////////////////////////////////////////////
+/**
+ * 将head_page换成新的reader_page, 旧的reader_page放回环形链表中.
+ * 不检查是否有可读的记录.
+ */
+static struct buf_page_meta *
+rb_swap_reader_page(struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader;
+
+    /* reset the older reader page */
+    rb_reset_page(buffer, buffer->reader_page);
+    if (buffer->flags & RB_FL_LAZY)
+        buffer->reader_page->drained = buffer->clock();
+
+    /* new reader_page is head_page */
+    reader = buffer->head_page;
+    if (!reader)
+        return NULL;
+    buffer->reader_page->list.next = rb_list_head(reader->list.next);
+    buffer->reader_page->list.prev = reader->list.prev;
+
+    /* the reader page will be pointing to the head */
+    rb_set_list_to_head(&buffer->reader_page->list);
+
+    // little trick, 将head_page->prev->next指向
+    // reader_page, 配合前后的操作实现将reader_page
+    // 插入新的head_page前，而旧的head_page则加入
+    // reader_page
+    rb_head_page_replace(reader, buffer->reader_page);
+    rb_list_head(reader->list.next)->prev = &buffer->reader_page->list;
+
+    // old reader_page->next 已经添加了head_page FLAG
+    // 可以放心设置head_page
+    rb_inc_page(buffer, &buffer->head_page);
+
+    // 旧的reader_page接替了旧head_page在环中的位置
+    buffer->reader_page->index = reader->index;
+    buffer->page_index[reader->index] = buffer->reader_page;
+
+    // update reader_page finally
+    buffer->reader_page = reader;
+    buffer->reader_page->read = rb_page_start(buffer);
+    rb_debug("[move](reader_page) change to new : <%p>\n", reader);
+
+    return reader;
+}
+
+/*
+ * 整页跳过reader_page上剩余的记录.
+ * 被跳过的最后一条记录可能延续到后面的page, 它的后续分片也一并跳过.
+ */
+static void
+rb_skip_reader_page(struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+    struct buf_page_meta *next;
+    struct ringbuf_item *item;
+
+    buffer->nr_read = reader->seq + reader->nr_entry;
+    reader->read = rb_page_size(reader);
+    reader->dropped = 1;
+
+    for (;;) {
+        next = rb_read_next_page(buffer, reader);
+        if (reader == buffer->tail_page ||
+                rb_page_size(next) == rb_page_start(buffer))
+            return;
+        item = rb_page_index(next, rb_page_start(buffer));
+        if (!rb_item_is_cont(buffer, item))
+            return;
+
+        reader = rb_swap_reader_page(buffer);
+        while (reader->read < rb_page_size(reader)) {
+            item = rb_reader_item(buffer);
+            if (!rb_item_is_cont(buffer, item))
+                return;
+            reader->read += rb_item_length(buffer, item);
+        }
+    }
+}
+
+// max_age: 读取一次时钟, 更新早于它即过期的时间戳
+static inline void
+rb_expire_refresh(struct ringbuf *buffer)
+{
+    u64 now = buffer->clock();
+
+    buffer->expire_stamp = now > buffer->max_age ? now - buffer->max_age : 0;
 }
 
-    
+/*
+ * max_age: reader_page上最新的记录也已超出保留时间时整页跳过, 返回1.
+ * 环中的page按时间排列, 之后的page只会更新.
+ * 先与缓存的 expire_stamp 比较, 它只会偏旧, 早于它的page一定已经过期;
+ * 只有换入的page看起来未过期(refresh)时才重新读取时钟. 因此连续跳过的
+ * 过期page不读时钟, 同一page上的每条记录也不读时钟.
+ */
+static int
+rb_expire_reader_page(struct ringbuf *buffer, int refresh)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+    u64 nr_read = buffer->nr_read;
+
+    if (reader->last_stamp >= buffer->expire_stamp) {
+        if (!refresh)
+            return 0;
+        rb_expire_refresh(buffer);
+        if (reader->last_stamp >= buffer->expire_stamp)
+            return 0;
+    }
+    rb_skip_reader_page(buffer);
+    buffer->nr_expired += buffer->nr_read - nr_read;
+    rb_debug("[r] page <%p> expired\n", reader);
+    return 1;
+}
 
-////////////////////////////////////////////
-// reader_page 相关
-////////////////////////////////////////////
 /**
  * 获取当前状态下合适的 reader page
  * 如果当前buffer->reader_page已经读取完毕，那么该函数还负责
@@ -207,6 +1708,9 @@ rb_get_reader_page(struct ringbuf *buffer)
     struct buf_page_meta *reader = buffer->reader_page;
 
     if (reader->read < rb_page_size(reader)) {
+        // 跳过过期的page时可能已经换入了后续分片所在的page
+        if (buffer->max_age && rb_expire_reader_page(buffer, 0))
+            return rb_get_reader_page(buffer);
         rb_debug("[move](reader_page) unmoved\n");
         return reader;
     }
@@ -220,38 +1724,29 @@ rb_get_reader_page(struct ringbuf *buffer)
         return NULL;
     }
 
-    /* reader_page needs to be moved */
-
-    /* reset the older reader page */
-    buffer->reader_page->write = 0;
-    buffer->reader_page->nr_entry = 0;
-
-    /* new reader_page is head_page */
-    reader = buffer->head_page;
-    if (!reader)
-        return NULL;
-    buffer->reader_page->list.next = rb_list_head(reader->list.next);
-    buffer->reader_page->list.prev = reader->list.prev;
-
-    /* the reader page will be pointing to the head */
-    rb_set_list_to_head(&buffer->reader_page->list);
-
-    // little trick, 将head_page->prev->next指向
-    // reader_page, 配合前后的操作实现将reader_page
-    // 插入新的head_page前，而旧的head_page则加入
-    // reader_page
-    rb_head_page_replace(reader, buffer->reader_page);
-    rb_list_head(reader->list.next)->prev = &buffer->reader_page->list;
-
-    // old reader_page->next 已经添加了head_page FLAG
-    // 可以放心设置head_page
-    rb_inc_page(buffer, &buffer->head_page);
-
-    // update reader_page finally
-    buffer->reader_page = reader;
-    buffer->reader_page->read = 0;
-    rb_debug("[move](reader_page) change to new : <%p>\n", reader);
-
+    if (buffer->hist)
+        rb_hist_save(buffer, reader);
+    if (rb_pool_shrinkable(buffer))
+        reader = rb_pool_shrink(buffer);
+    else
+        reader = rb_swap_reader_page(buffer);
+    // 每隔 RB_LAZY_IDLE_NS 检查一次空闲的page
+    if (buffer->flags & RB_FL_LAZY) {
+        u64 now = buffer->clock();
+        if (now - buffer->lazy_check >= RB_LAZY_IDLE_NS)
+            rb_lazy_release(buffer, now);
+    }
+    if (!rb_page_crc_ok(buffer, reader)) {
+        // 损坏的page整页丢弃
+        rb_debug("[r] crc mismatch on page <%p>\n", reader);
+        buffer->nr_crc_err += 1;
+        rb_skip_reader_page(buffer);
+        return rb_get_reader_page(buffer);
+    }
+    if (buffer->max_age && rb_expire_reader_page(buffer, 1))
+        return rb_get_reader_page(buffer);
+    rb_probe4(reader_page, buffer, reader, rb_page_size(reader),
+            rb_num_of_entry(buffer));
     return reader;
 }
 
@@ -259,6 +1754,7 @@ rb_get_reader_page(struct ringbuf *buffer)
  * 更新buffer的状态, 主要包括:
  * - reader_page->read
  * - buffer->nr_read
+ * 跨page的记录会依次越过它的所有分片, 但只计为一次读取.
  * TODO: 简化操作，或许不需要重新get_reader_page
  */
 static void rb_advance_reader(struct ringbuf *buffer)
@@ -267,14 +1763,23 @@ static void rb_advance_reader(struct ringbuf *buffer)
     struct buf_page_meta *reader;
     u32 length;  // length of item
 
-    reader = rb_get_reader_page(buffer);
-    if (!reader)
-        assert(0);
-    item = rb_reader_item(buffer);
-    buffer->nr_read += 1;
+    if (rb_mirror(buffer)) {
+        rb_mirror_advance(buffer);
+        return;
+    }
+
+    do {
+        reader = rb_get_reader_page(buffer);
+        if (!reader)
+            assert(0);
+        item = rb_reader_item(buffer);
+        length = rb_item_length(buffer, item);
+        buffer->reader_page->read += length;
+    } while (rb_item_has_next_frag(buffer, item));
 
-    length = rb_item_length(item);
-    buffer->reader_page->read += length;
+    if (buffer->flags & RB_FL_LATENCY)
+        rb_lat_consume(buffer, buffer->nr_read, buffer->clock());
+    buffer->nr_read += 1;
 }
 
 
@@ -289,6 +1794,13 @@ rb_buf_peek(struct ringbuf *buffer)
     struct buf_page_meta *reader;
     struct ringbuf_item *item;
     
+    if (rb_mirror(buffer))
+        return rb_mirror_peek(buffer);
+
+    // 写了一半的大记录不可读
+    if (rb_num_of_entry(buffer) == 0)
+        return NULL;
+
     reader = rb_get_reader_page(buffer);
     if (!reader)
         return NULL;
@@ -306,41 +1818,145 @@ rb_move_tail(struct ringbuf *buffer, u32 length)
     struct buf_page_meta *tail_page, *next_page;
 
     tail_page = buffer->tail_page;
-    next_page = tail_page;
-    
-    if (tail_page == buffer->reader_page){
-        next_page = buffer->head_page;
-    }
-    else {
-        rb_inc_page(buffer, &next_page);
-    }
+    next_page = rb_tail_next_page(buffer, tail_page);
 
     // 填满original tail_page, 使得不会在填入任何长度的item
     tail_page->write = BUF_PAGE_SIZE;
 
+    // 读完的page上还有记录被reader持有, 释放前不能覆盖.
+    // 借来的page插入在head_page之前, 也越不过这个page
+    if (rb_page_held(next_page)) {
+        rb_probe3(buffer_full, buffer, tail_page, length);
+        rb_debug("[move](tail_page) <%p> is still held\n", next_page);
+        return 1;
+    }
+
+    // 所有的page已经满了, 尝试从pool借用一个空page.
+    // 写满离开的page, write为BUF_PAGE_SIZE而commit可能还留有空隙,
+    // 因此按write判断page是否还能写入
+    if (rb_page_resident(buffer, next_page) &&
+            length + rb_page_write(next_page) > BUF_PAGE_SIZE &&
+            rb_pool_grow(buffer, 1))
+        next_page = rb_tail_next_page(buffer, tail_page);
+
     // ringbuffer 所有的page已经满了
-    if (length + rb_page_size(next_page) > BUF_PAGE_SIZE) {
+    if (rb_page_resident(buffer, next_page) &&
+            length + rb_page_write(next_page) > BUF_PAGE_SIZE) {
         next_page->write = BUF_PAGE_SIZE;
+        rb_probe3(buffer_full, buffer, tail_page, length);
         rb_debug("[move](tail_page) no more available pages!\n");
         return 1; 
     }
     
-    next_page->page->commit = 0;
+    rb_page_populate(buffer, next_page);
+    rb_page_seal(buffer, tail_page);
     buffer->tail_page = next_page;
+    if (buffer->flags & RB_FL_SAMPLE)
+        rb_sample_update(buffer);
+    rb_probe4(move_tail, buffer, tail_page, next_page, tail_page->page->commit);
     rb_debug("[move](tail_page) <%p> to <%p>\n", tail_page, next_page);
     return 0;
 }
 
+// item时间戳相对于page时间戳的增量超过u32时, 需要换到新的page
+static inline int
+rb_page_delta_overflow(struct ringbuf *buffer, struct buf_page_meta *bpage,
+        u64 ts)
+{
+    return rb_item_ts(buffer) && !rb_page_empty(buffer, bpage) &&
+        ts - bpage->page->time_stamp > UINT32_MAX;
+}
+
+/**
+ * 在tail_page上为一条完整的记录保留长度为length的空间(含header),
+ * 返回其起始位置, buffer已满时返回NULL. 当前page放不下时移动到下一个page.
+ * type: 记录的type, ts: 记录的时间戳
+ */
+static void *
+rb_reserve_space(struct ringbuf *buffer, u32 length, u32 type, u64 ts)
+{
+    // no enough space for this page
+    if (!rb_page_fits(buffer, length) ||
+            rb_page_delta_overflow(buffer, buffer->tail_page, ts)) {
+        // 所有的page都已写满, pool也借不到page
+        if (rb_move_tail(buffer, length))
+            return NULL;
+    }
+    rb_debug("[w] write in 0x%x bytes, remain 0x%lx bytes in current tail_page\n",
+            length, BUF_PAGE_SIZE-length-rb_page_write(buffer->tail_page));
+
+    return rb_page_claim(buffer, length, type, ts);
+}
+
+/**
+ * 检查从tail_page开始的空闲空间能否容纳一条被拆分成多个分片,
+ * 数据长度为length的记录. 已存有数据(commit不为0)的page视为不可用.
+ * 空闲的page不够时从pool借用, 借到的page即使不够也不归还.
+ * 仍被持有的page同样不可用, 借来的page插入在它之后, 也无法越过它.
+ */
+static int
+rb_frags_fit(struct ringbuf *buffer, u32 length)
+{
+    struct buf_page_meta *bpage = buffer->tail_page;
+    struct buf_page_meta *first = NULL;
+    u32 space = BUF_PAGE_SIZE - rb_page_write(bpage);
+    u32 per_page = rb_item_max_data(buffer, BUF_PAGE_SIZE - rb_page_start(buffer));
+
+    for (;;) {
+        if (space >= rb_item_space(buffer, 1) &&
+                rb_item_max_data(buffer, space)) {
+            length -= MIN(length, rb_item_max_data(buffer, space));
+            if (!length)
+                return 1;
+        }
+        bpage = rb_tail_next_page(buffer, bpage);
+        if (bpage != buffer->tail_page && rb_page_held(bpage))
+            return 0;
+        if (bpage == first || bpage == buffer->tail_page ||
+                (rb_page_resident(buffer, bpage) &&
+                 rb_page_commit(bpage) > rb_page_start(buffer))) {
+            u32 nr = DIV_ROUND_UP(length, per_page);
+            return rb_pool_grow(buffer, nr) == nr;
+        }
+        if (!first)
+            first = bpage;
+        space = BUF_PAGE_SIZE - rb_page_start(buffer);
+    }
+}
+
 ////////////////////////////////////////////
 // build 相关
 ////////////////////////////////////////////
-static void
-rb_init_page(struct buf_page *bpage)
+// 首个item的偏移, 使 page 内 item 的数据区按 buffer->align 对齐.
+// page 本身按 PAGE_SIZE 对齐分配.
+static u32
+rb_calc_page_start(struct ringbuf *buffer)
+{
+    u32 hdr = BUF_PAGE_HDR_SIZE;
+
+    if (rb_std_hdr(buffer))
+        hdr += rb_item_hdr_size(buffer);
+    return (buffer->align - hdr % buffer->align) % buffer->align;
+}
+
+#ifdef RB_ALLOC_DYNAMIC
+// RB_FL_LAZY 的page单独mmap: 堆上的内存可能已被使用过, 不能保证第一次写入前不占用物理内存
+static struct buf_page *
+rb_alloc_page(struct ringbuf *buffer)
 {
-    bpage->commit = 0;
+    void *page;
+
+    if (!(buffer->flags & RB_FL_LAZY))
+        return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return page == MAP_FAILED ? NULL : page;
 }
+#endif
+
 static int 
-__rb_allocate_pages(u32 nr_pages, struct list_head *pages)
+__rb_allocate_pages(struct ringbuf *buffer, u32 nr_pages,
+        struct list_head *pages)
 {
     struct buf_page_meta *bpage;
     struct buf_page *page;
@@ -348,15 +1964,15 @@ __rb_allocate_pages(u32 nr_pages, struct list_head *pages)
 
     for (i = 0; i < nr_pages; i++) {
 #ifdef RB_ALLOC_DYNAMIC
-        bpage = malloc(sizeof(*bpage));
+        bpage = rb_zalloc(sizeof(*bpage));
         if (!bpage)
             assert (0);
         rb_debug("[new] alloc new page <%p>\n",  bpage);
-        page = malloc(PAGE_SIZE);
+        page = rb_alloc_page(buffer);
         if (!page)
             assert(0);
 #else
-        assert(g_page_idx < nr_pages+1);
+        assert(g_page_idx < RB_STATIC_PAGES);
         bpage = &g_bpage[g_page_idx];
         page = (struct buf_page *)&g_page[g_page_idx];
         g_page_idx ++;
@@ -364,11 +1980,29 @@ __rb_allocate_pages(u32 nr_pages, struct list_head *pages)
         
         bpage->page = page;
         list_add(&bpage->list, pages);
-        rb_init_page(page);
+        rb_reset_page(buffer, bpage);
     }
     return 0;
 }
 
+// 按环中的顺序为各page编号, 使用pool时按最多的page数分配
+static int
+rb_build_page_index(struct ringbuf *buffer)
+{
+#ifdef RB_ALLOC_DYNAMIC
+    buffer->page_index = malloc(buffer->max_page * sizeof(*buffer->page_index));
+    if (!buffer->page_index)
+        return -1;
+#else
+    assert(g_page_index_idx + buffer->max_page <= RB_STATIC_PAGES);
+    buffer->page_index = &g_page_index[g_page_index_idx];
+    g_page_index_idx += buffer->max_page;
+#endif
+
+    rb_number_pages(buffer);
+    return 0;
+}
+
 static int
 rb_allocate_pages(struct ringbuf *buffer, u32 nr_pages)
 {
@@ -376,7 +2010,7 @@ rb_allocate_pages(struct ringbuf *buffer, u32 nr_pages)
         assert(0);
 
     LIST_HEAD(pages);
-    if(__rb_allocate_pages(nr_pages, &pages))
+    if(__rb_allocate_pages(buffer, nr_pages, &pages))
         return 1;
 
     /* 以上创建的pages仅仅是建立整个双向链表
@@ -386,51 +2020,469 @@ rb_allocate_pages(struct ringbuf *buffer, u32 nr_pages)
     list_del(&pages);
 
     buffer->nr_page = nr_pages;
+    buffer->head_page = list_entry(buffer->pages, struct buf_page_meta, list);
 
-    return 0;
+    return rb_build_page_index(buffer);
+}
+
+
+////////////////////////////////////////////
+// snapshot 相关
+////////////////////////////////////////////
+// spare的记录格式必须与buffer一致
+static inline int
+rb_spare_compatible(struct ringbuf *buffer, struct ringbuf *spare)
+{
+    return spare != buffer && !rb_mirror(buffer) &&
+        !((spare->flags ^ buffer->flags) & ~RB_FL_TRIGGER) &&
+        spare->data_start == buffer->data_start &&
+        spare->record_size == buffer->record_size &&
+        spare->max_page == buffer->max_page &&
+        spare->hist_size == buffer->hist_size;
+}
+
+// 清空buffer的所有page
+static void
+rb_reset_ring(struct ringbuf *buffer)
+{
+    for (u32 i = 0; i < buffer->nr_page; i++)
+        rb_reset_page(buffer, buffer->page_index[i]);
+    rb_reset_page(buffer, buffer->reader_page);
+    buffer->tail_page = buffer->head_page;
+    buffer->nr_read = buffer->nr_entry;
+    rb_hist_reset(buffer);
+}
+
+/*
+ * 交换两个buffer的page环, 不移动任何page.
+ * 交换后a从b的空page开始继续写入, 记录的序号保持连续.
+ */
+static void
+rb_swap_ring(struct ringbuf *a, struct ringbuf *b)
+{
+    struct ringbuf tmp = *a;
+
+    a->head_page = b->head_page;
+    a->tail_page = b->tail_page;
+    a->reader_page = b->reader_page;
+    a->pages = b->pages;
+    a->page_index = b->page_index;
+    a->nr_page = b->nr_page;
+
+    b->head_page = tmp.head_page;
+    b->tail_page = tmp.tail_page;
+    b->reader_page = tmp.reader_page;
+    b->pages = tmp.pages;
+    b->page_index = tmp.page_index;
+    b->nr_page = tmp.nr_page;
+    b->nr_entry = tmp.nr_entry;
+    b->nr_read = tmp.nr_read;
+    // 冻结的记录的commit时间随page一起交给b, 直方图仍属于各自的buffer
+    a->lat_stamp = b->lat_stamp;
+    b->lat_stamp = tmp.lat_stamp;
+    // history中的page在这些记录之前, 同样交给b
+    a->hist = b->hist;
+    a->hist_head = b->hist_head;
+    a->hist_tail = b->hist_tail;
+    a->nr_hist = b->nr_hist;
+    a->hist_raw = b->hist_raw;
+    b->hist = tmp.hist;
+    b->hist_head = tmp.hist_head;
+    b->hist_tail = tmp.hist_tail;
+    b->nr_hist = tmp.nr_hist;
+    b->hist_raw = tmp.hist_raw;
+
+    a->nr_read = a->nr_entry;
+}
+
+////////////////////////////////////////////
+// trigger 相关
+////////////////////////////////////////////
+static __always_inline int
+rb_stopped(struct ringbuf *buffer)
+{
+    return (buffer->flags & RB_FL_TRIGGER) &&
+        buffer->trig_state == RB_TRIG_FIRED &&
+        buffer->trigger->action == RB_TRIG_STOP;
+}
+
+// 记下正在写入的记录, 在commit时检查
+static __always_inline void
+rb_trigger_note(struct ringbuf *buffer, u32 type, const void *data, u32 len)
+{
+    if (!(buffer->flags & RB_FL_TRIGGER))
+        return;
+    buffer->trig_type = type;
+    buffer->trig_data = data;
+    buffer->trig_len = len;
+}
+
+static int
+rb_trigger_match(struct ringbuf *buffer)
+{
+    const struct ringbuf_trigger *trig = buffer->trigger;
+    const u8 *p = (const u8 *)buffer->trig_data + trig->offset;
+    u64 v;
+
+    if (buffer->trig_type != trig->type ||
+            trig->offset + trig->size > buffer->trig_len)
+        return 0;
+
+    switch (trig->size) {
+    case 1: v = *p; break;
+    case 2: { uint16_t x; memcpy(&x, p, 2); v = x; break; }
+    case 4: { u32 x; memcpy(&x, p, 4); v = x; break; }
+    default: memcpy(&v, p, 8); break;
+    }
+
+    switch (trig->cmp) {
+    case RB_CMP_EQ: return v == trig->value;
+    case RB_CMP_NE: return v != trig->value;
+    case RB_CMP_LT: return v < trig->value;
+    case RB_CMP_GE: return v >= trig->value;
+    default:        return (v & trig->value) != 0;  // RB_CMP_AND
+    }
 }
 
+/*
+ * 每次commit后调用. 条件满足后再经过 trigger->count 次commit执行action,
+ * 之后trigger失效. RB_TRIG_SNAPSHOT 要求 RB_FL_SNAPSHOT, writer持有buffer
+ * 的锁, 消费记录的接口此时被阻塞(rb_reader_lock), 直接交换page环即可.
+ * spare已在 ringbuf_set_trigger() 中清空.
+ */
+static void
+rb_trigger_commit(struct ringbuf *buffer)
+{
+    const struct ringbuf_trigger *trig = buffer->trigger;
+
+    if (buffer->trig_state == RB_TRIG_ARMED) {
+        if (!rb_trigger_match(buffer))
+            return;
+        buffer->trig_state = RB_TRIG_COUNTING;
+        buffer->trig_left = trig->count;
+    } else if (buffer->trig_state == RB_TRIG_COUNTING) {
+        buffer->trig_left -= 1;
+    } else {
+        return;
+    }
+    if (buffer->trig_left)
+        return;
+
+    buffer->trig_state = RB_TRIG_FIRED;
+    if (trig->action == RB_TRIG_SNAPSHOT)
+        rb_swap_ring(buffer, trig->spare);
+    rb_debug("[w] trigger fired at entry %llu\n",
+            (unsigned long long)buffer->nr_entry);
+}
 
 ////////////////////////////////////////////
 // commit 相关
 ////////////////////////////////////////////
+// writer 在 reserve 前加锁, commit 后解锁, 只对 RB_FL_SNAPSHOT/RB_FL_FLUSH 生效
+static __always_inline void
+rb_lock(struct ringbuf *buffer)
+{
+    if (!(buffer->flags & (RB_FL_SNAPSHOT | RB_FL_FLUSH)))
+        return;
+    while (__atomic_test_and_set(&buffer->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static __always_inline void
+rb_unlock(struct ringbuf *buffer)
+{
+    if (buffer->flags & (RB_FL_SNAPSHOT | RB_FL_FLUSH))
+        __atomic_clear(&buffer->lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * RB_FL_SNAPSHOT: commit触发的snapshot会在writer中交换reader_page/head_page,
+ * 消费记录的接口在访问reader状态期间也持有buffer的锁. 持锁时不能再写入
+ * 同一个buffer.
+ */
+static __always_inline void
+rb_reader_lock(struct ringbuf *buffer)
+{
+    if (buffer->flags & RB_FL_SNAPSHOT)
+        rb_lock(buffer);
+}
+
+static __always_inline void
+rb_reader_unlock(struct ringbuf *buffer)
+{
+    if (buffer->flags & RB_FL_SNAPSHOT)
+        rb_unlock(buffer);
+}
+
 static void 
 rb_commit(struct ringbuf *buffer, struct ringbuf_item *item)
 {
-    buffer->nr_entry += 1;
-    buffer->tail_page->page->commit = rb_page_write(buffer->tail_page);
+    if (buffer->flags & RB_FL_LATENCY)
+        rb_lat_commit(buffer);
+    if (rb_mirror(buffer)) {
+        buffer->nr_entry += 1;
+        rb_mirror_commit(buffer);
+        rb_probe4(commit, buffer, 0, buffer->mirror_commit, buffer->nr_entry);
+    } else {
+        rb_page_publish(buffer);
+        rb_probe4(commit, buffer, buffer->tail_page,
+                buffer->tail_page->page->commit, buffer->nr_entry);
+    }
+    if (buffer->flags & RB_FL_TRIGGER)
+        rb_trigger_commit(buffer);
+    rb_unlock(buffer);
 }
 
-#if 0
 ////////////////////////////////////////////
 // iterator 相关
 ////////////////////////////////////////////
-static void 
-rb_inc_iter(struct ringbuf_iter *iter)
+// 将iter定位到reader_page上第一条还在page中的记录, 包括已经消费的记录
+static inline void
+rb_iter_set_reader(struct ringbuf_iter *iter)
 {
+    struct buf_page_meta *reader = iter->buffer->reader_page;
 
-static __always_inline struct ringbuf_item *
-rb_iter_head_event(struct ringbuf_iter *iter)
+    iter->page = reader;
+    // 刚被清空的reader_page上的seq已经失效
+    if (reader->dropped || rb_page_empty(iter->buffer, reader)) {
+        iter->head = reader->read;
+        iter->seq = iter->buffer->nr_read;
+        return;
+    }
+    iter->head = rb_page_start(iter->buffer);
+    iter->seq = reader->seq;
+}
+
+// 遍历history时解压下一个block, history遍历完后从reader_page继续
+static void
+rb_iter_next_hist(struct ringbuf_iter *iter)
+{
+    struct ringbuf *buffer = iter->buffer;
+    struct rb_hist_block *blk;
+    u64 pos;
+
+    // 遍历期间reader又保存了page, iter的下一个block可能已被丢弃
+    if ((int64_t)(iter->hist - buffer->hist_head) < 0)
+        iter->hist = buffer->hist_head;
+    while (iter->hist != buffer->hist_tail) {
+        pos = iter->hist;
+        blk = rb_hist_block(buffer, pos);
+        iter->hist = rb_hist_next(buffer, pos);
+        if (blk->size == RB_HIST_PAD)
+            continue;
+        // 与环中的page一样, 看不到超出max_age的记录.
+        // ringbuf_iter_history() 已更新 expire_stamp
+        if (buffer->max_age && blk->last_stamp < buffer->expire_stamp)
+            continue;
+        rb_hist_load(buffer, pos);
+        iter->page = buffer->hist_page;
+        iter->head = rb_page_start(buffer);
+        iter->seq = blk->seq;
+        return;
+    }
+    rb_iter_set_reader(iter);
+}
+
+// reader 视角下iter所在page的下一个page
+static inline void
+rb_inc_iter(struct ringbuf_iter *iter)
 {
-    return rb_page_index(iter->head_page, iter->head);
+    if (iter->page == iter->buffer->hist_page) {
+        rb_iter_next_hist(iter);
+        return;
+    }
+    iter->page = rb_read_next_page(iter->buffer, iter->page);
+    iter->head = rb_page_start(iter->buffer);
 }
 
+/*
+ * 返回iter当前位置的记录, 不移动iter. 跳过page起始处属于上一条记录的
+ * 后续分片. 已遍历到最后一条已提交的记录时返回NULL.
+ */
 static struct ringbuf_item *
 rb_iter_peek(struct ringbuf_iter *iter)
 {
     struct ringbuf *buffer = iter->buffer;
+    struct ringbuf_item *item;
 
-again:
-    if (ringbuf_iter_empty(iter))
-        return NULL;
-    if (rb_buffer_empty(buffer))
-        return NULL;
-    
-    // 此page读取完成
-    if (iter->head >= rb_page_size(iter->head_page)) {
-        rb_inc_iter(iter);
-        goto again;
+    for (;;) {
+        if (iter->seq >= buffer->nr_entry)
+            return NULL;
+        // 此page读取完成
+        if (iter->head >= rb_page_size(iter->page)) {
+            rb_inc_iter(iter);
+            continue;
+        }
+        item = rb_page_index(iter->page, iter->head);
+        if (!rb_item_is_cont(buffer, item))
+            return item;
+        iter->head += rb_item_length(buffer, item);
     }
+}
+
+static inline void
+rb_iter_advance(struct ringbuf_iter *iter, struct ringbuf_item *item)
+{
+    iter->head += rb_item_length(iter->buffer, item);
+    iter->seq += 1;
+}
 
+/*
+ * 该page上的记录是否都不匹配mask, 可以整页跳过.
+ * 固定长度记录没有type; tail_page以及含有未提交记录的page不能跳过.
+ */
+static inline int
+rb_page_skippable(struct ringbuf *buffer, struct buf_page_meta *bpage,
+        u32 mask)
+{
+    return !rb_fixed(buffer) && !(bpage->types & mask) &&
+        bpage != buffer->tail_page &&
+        bpage->seq + bpage->nr_entry <= buffer->nr_entry;
 }
-#endif
+
+// 将iter定位到page的起始处
+static inline void
+rb_iter_set_page(struct ringbuf_iter *iter, struct buf_page_meta *bpage)
+{
+    iter->page = bpage;
+    iter->head = rb_page_start(iter->buffer);
+    iter->seq = bpage->seq;
+}
+
+// 环中从head_page到tail_page之间含有未读数据的page数
+static inline u32
+rb_nr_ring_pages(struct ringbuf *buffer)
+{
+    if (buffer->tail_page == buffer->reader_page)
+        return 0;
+    return (buffer->tail_page->index + buffer->nr_page -
+            buffer->head_page->index) % buffer->nr_page + 1;
+}
+
+// head_page之后的第k个page
+static inline struct buf_page_meta *
+rb_ring_page(struct ringbuf *buffer, u32 k)
+{
+    return buffer->page_index[(buffer->head_page->index + k) % buffer->nr_page];
+}
+
+////////////////////////////////////////////
+// merge 相关
+////////////////////////////////////////////
+// 堆中第i个元素是否排在第j个之前, 时间戳相同时按buffer的下标排序
+static inline int
+rb_merge_before(struct ringbuf_merge *merge, u32 i, u32 j)
+{
+    u8 a = merge->heap[i], b = merge->heap[j];
+
+    if (merge->ts[a] != merge->ts[b])
+        return merge->ts[a] < merge->ts[b];
+    return a < b;
+}
+
+static inline void
+rb_merge_swap(struct ringbuf_merge *merge, u32 i, u32 j)
+{
+    u8 tmp = merge->heap[i];
+
+    merge->heap[i] = merge->heap[j];
+    merge->heap[j] = tmp;
+}
+
+static void
+rb_merge_sift_up(struct ringbuf_merge *merge, u32 i)
+{
+    while (i && rb_merge_before(merge, i, (i - 1) / 2)) {
+        rb_merge_swap(merge, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+rb_merge_sift_down(struct ringbuf_merge *merge, u32 i)
+{
+    u32 min, l;
+
+    for (;;) {
+        min = i;
+        l = 2 * i + 1;
+        if (l < merge->nr_heap && rb_merge_before(merge, l, min))
+            min = l;
+        if (l + 1 < merge->nr_heap && rb_merge_before(merge, l + 1, min))
+            min = l + 1;
+        if (min == i)
+            return;
+        rb_merge_swap(merge, i, min);
+        i = min;
+    }
+}
+
+// 若第idx个buffer有可读的记录, 以其时间戳加入堆中
+static void
+rb_merge_push(struct ringbuf_merge *merge, u32 idx)
+{
+    struct ringbuf *buffer = merge->buffers[idx];
+    struct ringbuf_item *item;
+    struct ringbuf_entry entry;
+
+    item = rb_buf_peek(buffer);
+    if (!item)
+        return;
+    rb_item_to_entry(buffer, buffer->reader_page, item, &entry);
+    merge->ts[idx] = entry.ts;
+    merge->heap[merge->nr_heap] = idx;
+    merge->in_heap |= 1u << idx;
+    rb_merge_sift_up(merge, merge->nr_heap++);
+}
+
+// 移除堆顶
+static void
+rb_merge_pop(struct ringbuf_merge *merge)
+{
+    merge->in_heap &= ~(1u << merge->heap[0]);
+    merge->heap[0] = merge->heap[--merge->nr_heap];
+    rb_merge_sift_down(merge, 0);
+}
+
+////////////////////////////////////////////
+// flush 相关
+////////////////////////////////////////////
+// 该page上开始的记录是否都已提交
+static inline int
+rb_page_committed(struct ringbuf *buffer, struct buf_page_meta *bpage)
+{
+    return bpage->seq + bpage->nr_entry <= buffer->nr_entry;
+}
+
+// head_page已写满(writer已离开)且可以换出. 需持有buffer的锁
+static inline int
+rb_head_page_full(struct ringbuf *buffer)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+
+    return reader->read >= rb_page_size(reader) &&
+        reader != buffer->tail_page &&
+        buffer->head_page != buffer->tail_page &&
+        rb_page_committed(buffer, buffer->head_page);
+}
+
+/*
+ * 用spare替换环中的head_page, 返回换出的head_page.
+ * 与reader换入head_page的过程相同, 只是reader_page保持不变.
+ * 换出page上开始的记录视为已读取. 需持有buffer的锁.
+ */
+static struct buf_page_meta *
+rb_take_head_page(struct ringbuf *buffer, struct buf_page_meta *spare)
+{
+    struct buf_page_meta *reader = buffer->reader_page;
+    struct buf_page_meta *bpage;
+
+    buffer->reader_page = spare;
+    bpage = rb_swap_reader_page(buffer);
+    buffer->reader_page = reader;
+
+    buffer->nr_read = bpage->seq + bpage->nr_entry;
+    return bpage;
+}
+
+#endif // RB_CORE_FAST_PATH
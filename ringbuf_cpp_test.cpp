@@ -0,0 +1,53 @@
+/**
+ * @file ringbuf_cpp_test.cpp
+ * @brief  C++ 封装 ringbuf.hpp 的测试程序
+ * @version 0.1
+ * @date 2026-10-19
+ * 
+ * @copyright Copyright (c) 2026
+ */
+#include <cassert>
+#include <cstdio>
+#include <utility>
+#include "ringbuf.hpp"
+
+struct sample {
+    u32 seq;
+    u32 cpu;
+    uint64_t value;
+};
+
+int main()
+{
+    rb::ringbuf<sample> buffer(2 * 4096);
+    u32 seq = 0, next = 0;
+
+    static_assert(rb::ringbuf<sample>::slot == sizeof(sample), "no header");
+    static_assert(rb::ringbuf<sample>::align == 8, "aligned to the record");
+
+    for (int round = 0; round < 8; round++) {
+        for (int i = 0; i < 500; i++) {
+            sample *s = buffer.reserve();
+            s->seq = seq;
+            s->cpu = 0;
+            s->value = seq * 7ull;
+            buffer.commit(s);
+            seq++;
+        }
+        buffer.emplace(sample{ seq++, 1, 0 });
+
+        while (auto v = buffer.consume()) {
+            assert(v->seq == next);
+            assert(v->cpu ? v->value == 0 : v->value == next * 7ull);
+            // view 可以被移动, 原 view 不再持有记录
+            auto moved = std::move(v);
+            assert(!v && moved);
+            next++;
+        }
+        assert(buffer.empty());
+    }
+    assert(next == seq);
+    printf("c++ wrapper: %u records, %u per page\n", seq,
+            rb::ringbuf<sample>::per_page);
+    return 0;
+}
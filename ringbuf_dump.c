@@ -0,0 +1,86 @@
+/**
+ * @file ringbuf_dump.c
+ * @brief  ringbuf-dump: 解析 ringbuf_save() 写入的文件并打印其中的记录
+ *
+ * usage: ringbuf-dump [-n] <file>
+ *   -n  只打印文件头
+ *
+ * @version 0.1
+ * @date 2026-10-19
+ *
+ * @copyright Copyright (c) 2026
+ */
+#include <stdio.h>
+#include <string.h>
+#include "ringbuf.h"
+
+#define DUMP_BYTES 16   // 每条记录最多打印的数据字节数
+
+static const char *clock_name(u32 clock)
+{
+    switch (clock) {
+    case RB_CLOCK_NONE:      return "none";
+    case RB_CLOCK_MONOTONIC: return "monotonic";
+    default:                 return "custom";
+    }
+}
+
+static void dump_hdr(const struct ringbuf_file_hdr *hdr)
+{
+    printf("page_size: %u, nr_page: %u\n", hdr->page_size, hdr->nr_page);
+    printf("align: %u%s, data_start: %u, record_size: %u\n",
+            hdr->align, hdr->flags & RB_FL_ISOLATE ? " (isolated)" : "",
+            hdr->data_start, hdr->record_size);
+    printf("header: %s, clock: %s, crc: %s\n",
+            hdr->record_size ? "none" :
+            (hdr->flags & RB_FL_COMPACT) ? "compact" : "standard",
+            clock_name(hdr->clock), hdr->flags & RB_FL_CRC ? "crc32c" : "none");
+    printf("records: %llu, first seq: %llu\n",
+            (unsigned long long)hdr->nr_entry,
+            (unsigned long long)hdr->first_seq);
+}
+
+static void dump_entry(const struct ringbuf_entry *entry)
+{
+    const u8 *p = entry->data;
+
+    printf("%8llu %16llu %2u %6u ", (unsigned long long)entry->seq,
+            (unsigned long long)entry->ts, entry->type, entry->len);
+    for (u32 i = 0; i < entry->len && i < DUMP_BYTES; i++)
+        printf("%02x", p[i]);
+    printf("%s\n", entry->len > DUMP_BYTES ? "..." : "");
+}
+
+int main(int argc, char **argv)
+{
+    struct ringbuf_file file;
+    struct ringbuf_entry entry;
+    int hdr_only = 0, ret = 0;
+
+    if (argc == 3 && !strcmp(argv[1], "-n")) {
+        hdr_only = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: ringbuf-dump [-n] <file>\n");
+        return 2;
+    }
+    if (ringbuf_file_open(&file, argv[1])) {
+        fprintf(stderr, "%s: not a ringbuf file of this build\n", argv[1]);
+        return 1;
+    }
+
+    dump_hdr(file.hdr);
+    if (!hdr_only) {
+        printf("%8s %16s %2s %6s %s\n", "seq", "ts", "ty", "len", "data");
+        while ((ret = ringbuf_file_next(&file, &entry)) > 0)
+            dump_entry(&entry);
+        if (file.nr_crc_err)
+            printf("%u corrupted pages skipped\n", file.nr_crc_err);
+        if (ret < 0)
+            fprintf(stderr, "%s: corrupted page %u\n", argv[1], file.page);
+    }
+    ringbuf_file_close(&file);
+    return ret < 0;
+}
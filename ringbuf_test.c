@@ -7,10 +7,1288 @@
  * 
  * @copyright Copyright (c) 2023
  */
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include "ringbuf.h"
 
+/* 超过一个page的大记录会被拆分成多个分片写入 */
+static void test_large_record(void)
+{
+    struct ringbuf *buffer;
+    struct ringbuf_sg sg[8];
+    static char big[10000], out[10000];
+    char small[16] = "small";
+    u32 len, nr_frag, n;
+
+    for (int i = 0; i < sizeof(big); i++)
+        big[i] = i % 251;
+
+    buffer = ringbuf_alloc(4 * 4096);
+    for (int round = 0; round < 8; round++) {
+        ringbuf_write(buffer, strlen(small)+1, small);
+        assert(ringbuf_write(buffer, sizeof(big), big) == 0);
+        ringbuf_write(buffer, strlen(small)+1, small);
+
+        assert(!strcmp(ringbuf_item_data(ringbuf_consume(buffer)), small));
+
+        len = ringbuf_peek_length(buffer, &nr_frag);
+        assert(len == sizeof(big) && nr_frag > 1);
+        if (round % 2) {
+            /* 拷贝到caller提供的空间 */
+            assert(ringbuf_consume_copy(buffer, out, 16) == len);
+            assert(ringbuf_consume_copy(buffer, out, sizeof(out)) == len);
+            assert(!memcmp(out, big, len));
+        } else {
+            /* 直接访问各分片, 不拷贝 */
+            n = ringbuf_consume_sg(buffer, sg, 8);
+            assert(n == nr_frag);
+            len = 0;
+            for (int i = 0; i < n; i++) {
+                assert(!memcmp(sg[i].data, big + len, sg[i].len));
+                len += sg[i].len;
+            }
+            assert(len == sizeof(big));
+        }
+
+        assert(!strcmp(ringbuf_item_data(ringbuf_consume(buffer)), small));
+        assert(ringbuf_consume(buffer) == NULL);
+    }
+    printf("large record: %d bytes in %d fragments\n", len, nr_frag);
+
+    /* 超过buffer容量的记录写入失败 */
+    assert(ringbuf_write(buffer, sizeof(big) * 3, big) != 0);
+    ringbuf_free(buffer);
+}
+
+/* 按buffer设置item数据区的对齐 */
+static void test_align(void)
+{
+    u32 aligns[] = { 8, 16, RB_ALIGN_CACHELINE, RB_ALIGN_CACHELINE };
+    u32 flags[] = { 0, 0, 0, RB_FL_ISOLATE };
+    u32 min_space[] = { 8, 16, 64, 128 };
+    struct ringbuf_attr attr = { 0 };
+    struct ringbuf *buffer;
+    struct ringbuf_item *item;
+    static char data[6000];
+
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = i % 127;
+
+    for (int a = 0; a < 4; a++) {
+        attr.align = aligns[a];
+        attr.flags = flags[a];
+        buffer = ringbuf_alloc_attr(2 * 4096, &attr);
+        assert(ringbuf_item_size(buffer, 1) == min_space[a]);
+        for (int round = 0; round < 4; round++) {
+            for (u32 len = 1; len < 200; len += 13)
+                ringbuf_write(buffer, len, data);
+            assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+
+            for (u32 len = 1; len < 200; len += 13) {
+                item = ringbuf_consume(buffer);
+                assert((uintptr_t)ringbuf_item_data(item) % attr.align == 0);
+                assert(ringbuf_item_data_length(item) == len);
+                assert(!memcmp(ringbuf_item_data(item), data, len));
+            }
+            assert(ringbuf_peek_length(buffer, NULL) == sizeof(data));
+            assert(ringbuf_consume_copy(buffer, data, sizeof(data)) == sizeof(data));
+        }
+        printf("align %3d%s: 1 byte record takes %d bytes\n", attr.align,
+                attr.flags ? " isolated" : "", ringbuf_item_size(buffer, 1));
+        ringbuf_free(buffer);
+    }
+}
+
+/* 固定长度记录, item不含header */
+static void test_fixed_record(void)
+{
+    struct rec { u32 seq; u32 val; } r, *p;
+    struct ringbuf_attr attr = { .record_size = sizeof(struct rec) };
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    void *recs[64];
+    u32 seq = 0, next = 0, n;
+
+    buffer = ringbuf_alloc_attr(2 * 4096, &attr);
+    assert(ringbuf_item_size(buffer, sizeof(r)) == sizeof(r));
+    assert(ringbuf_write(buffer, 3, &r) != 0);
+
+    for (int round = 0; round < 8; round++) {
+        for (int i = 0; i < 700; i++) {
+            p = ringbuf_reserve(buffer, sizeof(*p));
+            p->seq = seq++;
+            p->val = p->seq * 3;
+            ringbuf_commit_data(buffer, p);
+        }
+
+        assert(ringbuf_consume_entry(buffer, &entry));
+        assert(entry.len == sizeof(r));
+        assert(((struct rec *)entry.data)->seq == next++);
+        while ((n = ringbuf_consume_records(buffer, recs, 64))) {
+            for (u32 i = 0; i < n; i++) {
+                p = recs[i];
+                assert(p->seq == next++ && p->val == p->seq * 3);
+            }
+        }
+        assert(next == seq);
+    }
+    printf("fixed record: %d records\n", seq);
+    ringbuf_free(buffer);
+}
+
+/* 紧凑header, 小记录只需1字节header */
+static void test_compact(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_COMPACT };
+    struct ringbuf *buffer, *std;
+    struct ringbuf_entry entry;
+    static char data[10000], out[10000];
+    u32 len;
+
+    for (int i = 0; i < sizeof(data); i++)
+        data[i] = i % 113;
+
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    std = ringbuf_alloc(2 * 4096);
+    assert(ringbuf_item_size(buffer, 1) == 2);
+    assert(ringbuf_item_size(buffer, 12) == 14);
+    printf("compact: 12 bytes record takes %d bytes, %d with standard header\n",
+            ringbuf_item_size(buffer, 12), ringbuf_item_size(std, 12));
+
+    for (int round = 0; round < 6; round++) {
+        for (len = 1; len < 300; len += 7)
+            ringbuf_write(buffer, len, data);
+        assert(ringbuf_write(buffer, 7000, data) == 0);
+
+        for (len = 1; len < 300; len += 7) {
+            assert(ringbuf_consume_entry(buffer, &entry));
+            assert(entry.len == len && !memcmp(entry.data, data, len));
+        }
+        assert(ringbuf_consume_copy(buffer, out, sizeof(out)) == 7000);
+        assert(!memcmp(out, data, 7000));
+        assert(!ringbuf_consume_entry(buffer, &entry));
+    }
+
+    // 写满buffer: 长度不一的记录使得各page尾部留下的空隙不同,
+    // 写满的page不能再被当作可写入的page
+    for (len = 0; ringbuf_write(buffer, len % 199 + 1, data) == 0; len += 37)
+        ;
+    assert(ringbuf_write(buffer, 1, data) != 0);
+    for (u32 n = 0; n < len; n += 37) {
+        assert(ringbuf_consume_entry(buffer, &entry));
+        assert(entry.len == n % 199 + 1 && !memcmp(entry.data, data, entry.len));
+    }
+    assert(!ringbuf_consume_entry(buffer, &entry));
+
+    ringbuf_free(std);
+    ringbuf_free(buffer);
+}
+
+static u64 fake_now;
+static u64 fake_clock(void)
+{
+    return fake_now;
+}
+
+static void test_seek(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_TIMESTAMP, .clock = fake_clock };
+    struct ringbuf *buffer;
+    struct ringbuf_iter iter;
+    struct ringbuf_entry entry;
+    static char big[6000];
+    u32 data;
+
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    // 每条记录的时间戳为 10 * seq, 中间夹一条跨page的大记录
+    for (data = 0; data < 1000; data++) {
+        fake_now = data * 10;
+        if (data == 500)
+            assert(ringbuf_write(buffer, sizeof(big), big) == 0);
+        else
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        // 消费一部分, 让reader page参与查找
+        if (data % 4 == 3)
+            assert(ringbuf_consume_entry(buffer, &entry));
+    }
+
+    ringbuf_iter_start(&iter, buffer);
+    assert(!ringbuf_seek_seq(&iter, buffer->nr_read - 1));
+    assert(!ringbuf_seek_seq(&iter, buffer->nr_entry));
+
+    for (u64 seq = buffer->nr_read; seq < buffer->nr_entry; seq += 37) {
+        assert(ringbuf_seek_seq(&iter, seq));
+        assert(ringbuf_iter_next(&iter, &entry));
+        assert(entry.seq == seq && entry.ts == seq * 10);
+        if (seq != 500)
+            assert(*(u32 *)entry.data == seq);
+    }
+
+    assert(ringbuf_seek_time(&iter, 5005));
+    assert(ringbuf_iter_next(&iter, &entry));
+    assert(entry.seq == 501 && entry.ts == 5010);
+    assert(!ringbuf_seek_time(&iter, 10000));
+
+    // 迭代器不消费数据
+    ringbuf_peek_entry(buffer, &entry);
+    assert(entry.seq == buffer->nr_read);
+    printf("seek: %llu records in buffer, first seq %llu\n",
+            (unsigned long long)(buffer->nr_entry - buffer->nr_read),
+            (unsigned long long)entry.seq);
+    ringbuf_free(buffer);
+}
+
+static void test_filter(void)
+{
+    struct ringbuf *buffer;
+    struct ringbuf_iter iter;
+    struct ringbuf_entry entry;
+    static char big[9000];
+    u32 data, n;
+
+    buffer = ringbuf_alloc(4 * 4096);
+    for (int round = 0; round < 4; round++) {
+        // type 1 的记录集中在前几个page, 中间夹一条跨page的 type 3 大记录
+        for (data = 0; data < 300; data++)
+            assert(ringbuf_write_type(buffer, 1, sizeof(data), &data) == 0);
+        assert(ringbuf_write_type(buffer, 3, sizeof(big), big) == 0);
+        for (data = 0; data < 100; data++)
+            assert(ringbuf_write_type(buffer, data % 2 ? 2 : 1,
+                        sizeof(data), &data) == 0);
+
+        ringbuf_iter_start(&iter, buffer);
+        for (n = 0; ringbuf_iter_next_filter(&iter, RB_TYPE_MASK(2), &entry); n++)
+            assert(entry.type == 2 && *(u32 *)entry.data == 2 * n + 1);
+        assert(n == 50);
+        ringbuf_iter_start(&iter, buffer);
+        assert(ringbuf_iter_next_filter(&iter, RB_TYPE_MASK(3), &entry));
+        assert(entry.type == 3 && entry.seq == buffer->nr_read + 300);
+
+        for (n = 0; ringbuf_consume_filter(buffer, RB_TYPE_MASK(2), &entry); n++)
+            assert(entry.type == 2 && *(u32 *)entry.data == 2 * n + 1);
+        assert(n == 50);
+        assert(buffer->nr_read == buffer->nr_entry);
+    }
+    ringbuf_free(buffer);
+}
+
+static void test_snapshot(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_SNAPSHOT };
+    struct ringbuf *buffer, *snap;
+    struct ringbuf_iter iter;
+    struct ringbuf_entry entry;
+    u32 data, n;
+
+    buffer = ringbuf_alloc_attr(2 * 4096, &attr);
+    snap = ringbuf_alloc_snapshot(buffer);
+    for (int round = 0; round < 3; round++) {
+        for (data = 0; data < 500; data++)
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        for (n = 0; n < 100; n++)
+            assert(ringbuf_consume_entry(buffer, &entry));
+
+        // 冻结后继续写入, 两者互不影响
+        snap = ringbuf_snapshot(buffer, snap);
+        assert(buffer->nr_entry == buffer->nr_read);
+        for (data = 1000; data < 1200; data++)
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+
+        ringbuf_iter_start(&iter, snap);
+        for (n = 100; ringbuf_iter_next(&iter, &entry); n++)
+            assert(*(u32 *)entry.data == n && entry.seq == round * 700 + n);
+        assert(n == 500);
+        for (n = 1000; ringbuf_consume_entry(buffer, &entry); n++)
+            assert(*(u32 *)entry.data == n && entry.seq == round * 700 + n - 500);
+        assert(n == 1200);
+    }
+    ringbuf_free(snap);
+    ringbuf_free(buffer);
+}
+
+#define TRIG_RECORDS 20000
+
+static void *trigger_writer(void *arg)
+{
+    struct ringbuf *buffer = arg;
+    u32 data[2];
+
+    for (u32 n = 0; n < TRIG_RECORDS; n++) {
+        data[0] = n;
+        while (ringbuf_write_type(buffer, 1, sizeof(data), data))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_trigger(void)
+{
+    struct ringbuf *buffer, *snap;
+    struct ringbuf_trigger trig = {
+        .type = 2, .offset = 4, .size = 4, .cmp = RB_CMP_EQ, .value = 60,
+        .action = RB_TRIG_STOP, .count = 3,
+    };
+    struct ringbuf_entry entry;
+    static u8 seen[TRIG_RECORDS];
+    pthread_t thread;
+    u32 data[2], n;
+
+    buffer = ringbuf_alloc_attr(2 * 4096, &(struct ringbuf_attr){ .flags = RB_FL_SNAPSHOT });
+    snap = ringbuf_alloc_snapshot(buffer);
+
+    // 第60条记录满足条件, 之后再接受3条
+    ringbuf_set_trigger(buffer, &trig);
+    for (n = 0; n < 100; n++) {
+        data[0] = n;
+        data[1] = n;
+        if (ringbuf_write_type(buffer, n < 50 ? 1 : 2, sizeof(data), data))
+            break;
+    }
+    assert(ringbuf_trigger_fired(buffer) && n == 64);
+    assert(!ringbuf_reserve(buffer, 4));
+    ringbuf_set_trigger(buffer, NULL);
+    assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    while (ringbuf_consume_entry(buffer, &entry))
+        ;
+
+    // 满足条件时立即冻结
+    trig.type = 1;
+    trig.offset = 0;
+    trig.cmp = RB_CMP_GE;
+    trig.value = 30;
+    trig.action = RB_TRIG_SNAPSHOT;
+    trig.count = 0;
+    trig.spare = snap;
+    ringbuf_set_trigger(buffer, &trig);
+    for (n = 0; n < 100; n++) {
+        data[0] = n;
+        assert(ringbuf_write_type(buffer, 1, sizeof(data), data) == 0);
+    }
+    assert(ringbuf_trigger_fired(buffer));
+    for (n = 0; ringbuf_consume_entry(snap, &entry); n++)
+        assert(((u32 *)entry.data)[0] == n);
+    assert(n == 31);
+    for (n = 31; ringbuf_consume_entry(buffer, &entry); n++)
+        assert(((u32 *)entry.data)[0] == n);
+    assert(n == 100);
+
+    // writer在另一个线程中触发snapshot, reader同时消费: 每条记录恰好出现一次,
+    // 或者已被reader消费, 或者在snap中
+    trig.value = TRIG_RECORDS / 2;
+    ringbuf_set_trigger(buffer, &trig);
+    assert(pthread_create(&thread, NULL, trigger_writer, buffer) == 0);
+    for (n = 0; n != TRIG_RECORDS - 1; ) {
+        if (!ringbuf_consume_entry(buffer, &entry)) {
+            sched_yield();
+            continue;
+        }
+        assert(((u32 *)entry.data)[0] >= n);
+        n = ((u32 *)entry.data)[0];
+        seen[n]++;
+    }
+    pthread_join(thread, NULL);
+    assert(ringbuf_trigger_fired(buffer));
+    while (ringbuf_consume_entry(snap, &entry))
+        seen[((u32 *)entry.data)[0]]++;
+    for (n = 0; n < TRIG_RECORDS; n++)
+        assert(seen[n] == 1);
+
+    ringbuf_set_trigger(buffer, NULL);
+    ringbuf_free(snap);
+    ringbuf_free(buffer);
+}
+
+static void test_merge(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_TIMESTAMP, .clock = fake_clock };
+    struct ringbuf *buffers[3];
+    struct ringbuf_merge merge;
+    struct ringbuf_entry entry;
+    u64 last = 0;
+    u32 data, idx, n;
+
+    for (int i = 0; i < 3; i++)
+        buffers[i] = ringbuf_alloc_attr(2 * 4096, &attr);
+
+    // 时间戳为data, 按 data % 3 分散到各buffer, buffer 2 先不写入
+    for (data = 0; data < 300; data++) {
+        fake_now = data;
+        if (data % 3 != 2)
+            ringbuf_write(buffers[data % 3], sizeof(data), &data);
+    }
+    ringbuf_merge_init(&merge, buffers, 3);
+    for (n = 0; n < 100; n++) {
+        assert(ringbuf_merge_next(&merge, &entry, &idx));
+        assert(entry.ts >= last && entry.ts == *(u32 *)entry.data);
+        assert(idx == *(u32 *)entry.data % 3);
+        last = entry.ts;
+    }
+    // 之前为空的buffer有了新数据
+    for (data = 300; data < 400; data++) {
+        fake_now = data;
+        ringbuf_write(buffers[2], sizeof(data), &data);
+    }
+    for (; ringbuf_merge_next(&merge, &entry, &idx); n++) {
+        assert(entry.ts >= last && entry.ts == *(u32 *)entry.data);
+        last = entry.ts;
+    }
+    assert(n == 300);
+
+    for (int i = 0; i < 3; i++) {
+        assert(buffers[i]->nr_read == buffers[i]->nr_entry);
+        ringbuf_free(buffers[i]);
+    }
+}
+
+static void test_save(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_TIMESTAMP, .clock = fake_clock };
+    struct ringbuf *buffer;
+    struct ringbuf_iter iter;
+    struct ringbuf_entry entry, saved;
+    struct ringbuf_file file;
+    static char big[6000];
+    char path[] = "/tmp/ringbuf_test_XXXXXX";
+    u32 data, first;
+    int fd, ret;
+
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    for (data = 0; data < 800; data++) {
+        fake_now = 1000 + data;
+        if (data == 400)
+            assert(ringbuf_write_type(buffer, 3, sizeof(big), big) == 0);
+        else
+            assert(ringbuf_write_type(buffer, data % 4, sizeof(data), &data) == 0);
+        if (data % 3 == 0)
+            assert(ringbuf_consume_entry(buffer, &entry));
+    }
+
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(ringbuf_save(buffer, fd) == 0);
+    close(fd);
+
+    // 文件中的记录与buffer中未消费的记录完全相同
+    assert(ringbuf_file_open(&file, path) == 0);
+    assert(file.hdr->nr_entry == buffer->nr_entry - buffer->nr_read);
+    ringbuf_iter_start(&iter, buffer);
+    while (ringbuf_iter_next(&iter, &entry)) {
+        assert(ringbuf_file_next(&file, &saved) == 1);
+        assert(saved.seq == entry.seq && saved.ts == entry.ts &&
+                saved.type == entry.type && saved.len == entry.len &&
+                !memcmp(saved.data, entry.data, entry.len));
+    }
+    assert(ringbuf_file_next(&file, &saved) == 0);
+    first = file.hdr->first_offset;
+    ringbuf_file_close(&file);
+
+    // 没有CRC时, 越界的commit或记录长度使读取返回错误而不是越界访问
+    fd = open(path, O_RDWR);
+    data = 0xffff;
+    assert(pwrite(fd, &data, sizeof(data),
+                2 * 4096 + offsetof(struct buf_page, commit)) == sizeof(data));
+    assert(ringbuf_file_open(&file, path) == 0);
+    while ((ret = ringbuf_file_next(&file, &saved)) > 0)
+        ;
+    assert(ret < 0 && file.page == 1);
+    ringbuf_file_close(&file);
+    data = 0xffffffff;
+    assert(pwrite(fd, &data, sizeof(data),
+                4096 + offsetof(struct buf_page, data) + first) == sizeof(data));
+    close(fd);
+    assert(ringbuf_file_open(&file, path) == 0);
+    while ((ret = ringbuf_file_next(&file, &saved)) > 0)
+        ;
+    assert(ret < 0 && file.page == 0);
+    ringbuf_file_close(&file);
+    unlink(path);
+    ringbuf_free(buffer);
+}
+
+static void test_flush(void)
+{
+    struct ringbuf *buffer;
+    struct ringbuf_flusher flusher;
+    struct ringbuf_file file;
+    struct ringbuf_entry entry;
+    static char big[6000];
+    char path[] = "/tmp/ringbuf_test_XXXXXX";
+    u32 data, n;
+    int fd;
+
+    buffer = ringbuf_alloc(8 * 4096);
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(ringbuf_flush_start(&flusher, buffer, fd) == 0);
+
+    // 应用只管写入, 每写一批等flush线程跟上, 避免写满buffer
+    for (data = 0; data < 20000; data++) {
+        if (data % 1000 == 999)
+            assert(ringbuf_write_type(buffer, 1, sizeof(big), big) == 0);
+        else
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        if (data % 1000 == 0) {
+            while (buffer->nr_entry - __atomic_load_n(&buffer->nr_read,
+                        __ATOMIC_ACQUIRE) > 1000)
+                usleep(100);
+        }
+    }
+    assert(ringbuf_flush_stop(&flusher) == 0);
+    assert(buffer->nr_read == buffer->nr_entry);
+    close(fd);
+
+    assert(ringbuf_file_open(&file, path) == 0);
+    for (n = 0; ringbuf_file_next(&file, &entry) > 0; n++) {
+        assert(entry.seq == n);
+        if (n % 1000 == 999)
+            assert(entry.type == 1);
+        else
+            assert(entry.len == sizeof(n) && *(u32 *)entry.data == n);
+    }
+    assert(n == 20000);
+    printf("flush: %u records in %u pages\n", n, file.hdr->nr_page);
+    ringbuf_file_close(&file);
+    unlink(path);
+    ringbuf_free(buffer);
+}
+
+static void test_crc(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_CRC };
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    struct ringbuf_file file;
+    char path[] = "/tmp/ringbuf_test_XXXXXX";
+    u32 data, n, lost;
+    int fd;
+
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    for (data = 0; data < 2000; data++)
+        assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+
+    // 保存后再破坏文件中第二个page的一个字节
+    fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(ringbuf_save(buffer, fd) == 0);
+    assert(pwrite(fd, "x", 1, 2 * 4096 + 100) == 1);
+    close(fd);
+    assert(ringbuf_file_open(&file, path) == 0);
+    for (n = 0; ringbuf_file_next(&file, &entry) > 0; n++)
+        ;
+    assert(file.nr_crc_err == 1 && n < 2000);
+    ringbuf_file_close(&file);
+    unlink(path);
+
+    // 破坏内存中已写满的第二个page, reader整页丢弃
+    buffer->page_index[(buffer->head_page->index + 1) % buffer->nr_page]->page->data[40] ^= 1;
+    for (n = 0, lost = 0; ringbuf_consume_entry(buffer, &entry); n++) {
+        if (*(u32 *)entry.data != n + lost)
+            lost = *(u32 *)entry.data - n;
+    }
+    assert(buffer->nr_crc_err == 1 && lost > 0 && n + lost == 2000);
+    printf("crc: dropped a corrupted page of %u records\n", lost);
+    ringbuf_free(buffer);
+}
+
+static void *pool_worker(void *arg)
+{
+    struct ringbuf *buffer = arg;
+    struct ringbuf_entry entry;
+    u32 data, next = 0;
+
+    // 每轮写入超过自有page的数据, 再全部读出, 与另一个线程并发借还page
+    for (int round = 0; round < 200; round++) {
+        for (data = next; data < next + 3000; data++)
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        for (; ringbuf_consume_entry(buffer, &entry); next++)
+            assert(*(u32 *)entry.data == next);
+    }
+    return NULL;
+}
+
+static void test_pool(void)
+{
+    struct ringbuf_pool pool;
+    struct ringbuf_attr attr = { .max_size = 6 * 4096 };
+    struct ringbuf *a, *b;
+    struct ringbuf_entry entry;
+    static char big[3 * 4096];
+    pthread_t thread[2];
+    u32 data, n;
+
+    assert(ringbuf_pool_init(&pool, 8) == 0);
+    attr.pool = &pool;
+    a = ringbuf_alloc_attr(0, &attr);
+    attr.max_size = 0;
+    b = ringbuf_alloc_attr(0, &attr);
+
+    // a写满自有的2个page后借到上限为止
+    for (data = 0; ringbuf_write(a, sizeof(data), &data) == 0; data++)
+        ;
+    assert(a->nr_page == a->max_page && a->max_page < 2 + 8);
+    assert(pool.nr_free == 8 - (a->nr_page - 2));
+    // b借走pool剩下的全部page
+    for (n = 0; ringbuf_write(b, sizeof(n), &n) == 0; n++)
+        ;
+    assert(b->nr_page + a->nr_page == 2 + 2 + 8 && pool.nr_free == 0);
+
+    // 读完借来的page后归还, 只有writer所在的page还留在buffer中
+    for (n = 0; ringbuf_consume_entry(a, &entry); n++)
+        assert(*(u32 *)entry.data == n);
+    assert(n == data && a->nr_page <= 2 + 1);
+    while (ringbuf_consume_entry(b, &entry))
+        ;
+    assert(b->nr_page <= 2 + 1);
+    assert(pool.nr_free + a->nr_page + b->nr_page == 8 + 2 + 2);
+    // 之后b可以写入跨page的大记录
+    assert(ringbuf_write(b, sizeof(big), big) == 0);
+    assert(ringbuf_consume_copy(b, big, sizeof(big)) == sizeof(big));
+    printf("pool: %u records in %u pages, returned on drain\n", data, a->max_page);
+
+    assert(pthread_create(&thread[0], NULL, pool_worker, a) == 0);
+    assert(pthread_create(&thread[1], NULL, pool_worker, b) == 0);
+    pthread_join(thread[0], NULL);
+    pthread_join(thread[1], NULL);
+    assert(pool.nr_free + a->nr_page + b->nr_page == 8 + 2 + 2);
+
+    ringbuf_free(a);
+    ringbuf_free(b);
+    ringbuf_pool_destroy(&pool);
+}
+
+// buffer中占用物理内存的page数
+static u32 resident_pages(struct ringbuf *buffer)
+{
+    unsigned char vec;
+    u32 nr = 0;
+
+    for (u32 i = 0; i < buffer->nr_page; i++) {
+        assert(mincore(buffer->page_index[i]->page, 4096, &vec) == 0);
+        nr += vec & 1;
+    }
+    return nr;
+}
+
+static void test_lazy(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_LAZY, .clock = fake_clock };
+    struct ringbuf *buffer;
+    struct ringbuf_entry entry;
+    u32 data, n = 0, before;
+
+    fake_now = 0;
+    buffer = ringbuf_alloc_attr(32 * 4096, &attr);
+    // 只有writer所在的page被写入
+    assert(resident_pages(buffer) == 1);
+
+    // 写入几个page后读完
+    for (data = 0; data < 2000; data++)
+        assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+    before = resident_pages(buffer);
+    assert(before > 1 && before < 8);
+    for (; ringbuf_consume_entry(buffer, &entry); n++)
+        assert(*(u32 *)entry.data == n);
+
+    // 空闲时间未到时不释放. 读完后writer所在的page成为reader_page,
+    // 原来的reader_page回到环中, 之后环中读完的page都被释放
+    assert(ringbuf_release_idle(buffer) == 0);
+    fake_now = RB_LAZY_IDLE_NS;
+    assert(ringbuf_release_idle(buffer) == before);
+    assert(resident_pages(buffer) == 0);
+
+    // 被释放的page仍在环中, 可以再次写入
+    for (; data < 40 * 1000; data++) {
+        assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        if (data % 1000 == 0)
+            for (; ringbuf_consume_entry(buffer, &entry); n++)
+                assert(*(u32 *)entry.data == n);
+    }
+    for (; ringbuf_consume_entry(buffer, &entry); n++)
+        assert(*(u32 *)entry.data == n);
+    assert(n == data);
+    printf("lazy: released %u idle pages\n", before);
+    ringbuf_free(buffer);
+}
+
+#define MIRROR_RECORDS 100000
+
+// 第n条记录的长度在1~3KiB之间, 内容由n决定
+static u32 mirror_len(u32 n)
+{
+    return 1024 + n * 7919 % 2048;
+}
+
+static void *mirror_writer(void *arg)
+{
+    struct ringbuf *buffer = arg;
+    static u8 data[4096];
+
+    for (u32 n = 0; n < MIRROR_RECORDS; ) {
+        memset(data, (u8)n, mirror_len(n));
+        memcpy(data, &n, sizeof(n));
+        if (ringbuf_write(buffer, mirror_len(n), data) == 0)
+            n++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_mirror(void)
+{
+    struct ringbuf_attr attr = { .flags = RB_FL_MIRROR };
+    struct ringbuf *buffer;
+    struct ringbuf_item *item;
+    struct ringbuf_entry entry;
+    static u8 data[4096];
+    pthread_t thread;
+    u32 n, used = 0, wrapped = 0;
+    u8 *p;
+
+    buffer = ringbuf_alloc_attr(3 * 4096, &attr);
+    assert(buffer->mirror_size == 3 * 4096);
+
+    // 写满时记录之间没有padding, 只剩下不足一条记录的空间
+    for (n = 0; ringbuf_write(buffer, mirror_len(n), data) == 0; n++)
+        used += ringbuf_item_size(buffer, mirror_len(n));
+    assert(buffer->mirror_size - used < ringbuf_item_size(buffer, mirror_len(n)));
+
+    // 越过数据区末尾的记录仍然是连续的
+    for (n = 0; n < 1000; n++) {
+        while ((item = ringbuf_consume(buffer)))
+            ;
+        memset(data, (u8)n, mirror_len(n));
+        assert(ringbuf_write(buffer, mirror_len(n), data) == 0);
+        item = ringbuf_consume(buffer);
+        p = ringbuf_item_data(item);
+        assert(ringbuf_item_data_length(item) == mirror_len(n));
+        assert(p[0] == (u8)n && p[mirror_len(n) - 1] == (u8)n);
+        if (p + mirror_len(n) > buffer->mirror + buffer->mirror_size)
+            wrapped++;
+    }
+    assert(wrapped > 0);
+
+    // writer和reader在不同的线程
+    assert(pthread_create(&thread, NULL, mirror_writer, buffer) == 0);
+    for (n = 0; n < MIRROR_RECORDS; ) {
+        if (!ringbuf_consume_entry(buffer, &entry)) {
+            sched_yield();
+            continue;
+        }
+        p = entry.data;
+        assert(entry.len == mirror_len(n) && *(u32 *)p == n);
+        assert(p[entry.len - 1] == (u8)n);
+        n++;
+    }
+    pthread_join(thread, NULL);
+    printf("mirror: %u records wrapped the end, %u bytes unused when full\n",
+            wrapped, buffer->mirror_size - used);
+    ringbuf_free(buffer);
+}
+
+/*
+ * rb_copy_data()按长度选择拷贝方式: 定长的小记录, 普通memcpy,
+ * 以及 RB_FL_NT_COPY 时不短于 RB_NT_COPY_MIN 的non-temporal store(含未对齐的首尾).
+ */
+static void test_copy(void)
+{
+    u32 lens[] = { 1, 2, 4, 8, 16, 32, 33, 2047, 2048, 2049, 3001, 9000 };
+    struct ringbuf_attr attrs[] = {
+        { 0 },
+        { .flags = RB_FL_NT_COPY },
+        { .flags = RB_FL_NT_COPY | RB_FL_COMPACT },  // 不对齐, 数据区的起始地址是任意的
+    };
+    static u8 data[9000 + 8], out[9000];
+    struct ringbuf *buffer;
+    u32 n = sizeof(lens)/sizeof(lens[0]);
+
+    for (u32 i = 0; i < sizeof(data); i++)
+        data[i] = i * 131 + (i >> 8);
+    for (int a = 0; a < 3; a++) {
+        buffer = ringbuf_alloc_attr(16 * 4096, &attrs[a]);
+        for (u32 round = 0; round < 8; round++) {
+            for (u32 i = 0; i < n; i++)
+                assert(ringbuf_write(buffer, lens[i], data + round) == 0);
+            for (u32 i = 0; i < n; i++) {
+                assert(ringbuf_consume_copy(buffer, out, sizeof(out)) == lens[i]);
+                assert(memcmp(out, data + round, lens[i]) == 0);
+            }
+        }
+        ringbuf_free(buffer);
+    }
+}
+
+/*
+ * RB_FL_LATENCY: 用假时钟控制每条记录从commit到consume的时间,
+ * 检查直方图的统计、百分位数、清零及commit时间被覆盖的情况.
+ */
+static void test_latency(void)
+{
+    u32 flags[] = { RB_FL_LATENCY, RB_FL_LATENCY | RB_FL_MIRROR };
+    struct ringbuf_attr attr = { .clock = fake_clock };
+    struct ringbuf_latency hist;
+    struct ringbuf_entry entry;
+    struct ringbuf *buffer;
+    u32 data = 0;
+
+    for (int f = 0; f < 2; f++) {
+        attr.flags = flags[f];
+        buffer = ringbuf_alloc_attr(16 * 4096, &attr);
+
+        // 第i条记录等待 i*100 ns
+        fake_now = 1000000;
+        for (u32 i = 0; i < 100; i++) {
+            fake_now -= 100;
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        }
+        fake_now = 1000000;
+        for (u32 i = 0; i < 100; i++)
+            assert(ringbuf_consume_entry(buffer, &entry));
+        ringbuf_latency_read(buffer, &hist, 0);
+        assert(hist.total == 100 && hist.missed == 0);
+        assert(hist.max == 10000 && hist.sum == 100ull * 101 / 2 * 100);
+        // 相对误差不超过 1/16
+        assert(ringbuf_latency_percentile(&hist, 50) >= 5000 &&
+                ringbuf_latency_percentile(&hist, 50) <= 5000 + 5000 / 16);
+        assert(ringbuf_latency_percentile(&hist, 100) == 10000);
+
+        // 读取的同时清零
+        ringbuf_latency_read(buffer, &hist, 1);
+        ringbuf_latency_read(buffer, &hist, 0);
+        assert(hist.total == 0 && hist.max == 0);
+        assert(ringbuf_latency_percentile(&hist, 99) == 0);
+
+        // 未消费的记录超过 RB_LAT_SLOTS 条, 较早记录的commit时间已被覆盖
+        for (u32 i = 0; i < RB_LAT_SLOTS + 10; i++)
+            assert(ringbuf_write(buffer, sizeof(data), &data) == 0);
+        while (ringbuf_consume_entry(buffer, &entry))
+            ;
+        ringbuf_latency_read(buffer, &hist, 0);
+        assert(hist.missed == 11 && hist.total == RB_LAT_SLOTS - 1);
+        assert(hist.count[0] == hist.total);
+        ringbuf_free(buffer);
+    }
+}
+
+/*
+ * 控制记录(lane 0)与大量积压的批量记录(lane 1)共用一个 ringbuf_lanes:
+ * 严格优先级下控制记录总是先被读到, 加权轮询下按weight交替读取,
+ * 批量lane写满自有的page后借用共享的page, DROP_OLD 的lane保留最新的记录.
+ */
+#define LANE_RECORDS 100000
+
+static void *lanes_writer(void *arg)
+{
+    struct ringbuf_lanes *lanes = arg;
+
+    for (u32 n = 0; n < LANE_RECORDS; n++) {
+        assert(ringbuf_lanes_write(lanes, 2, sizeof(n), &n) == 0);
+        if (n % 64 == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_lanes(void)
+{
+    struct ringbuf_lane_attr attrs[3] = {
+        { .size = 4096 },
+        { .size = 4 * 4096, .weight = 3 },
+        { .size = 2 * 4096, .policy = RB_LANE_DROP_OLD },
+    };
+    struct ringbuf_lanes lanes;
+    struct ringbuf_entry entry;
+    u32 data, lane, n, nr_bulk, expect;
+    u32 seen[3] = { 0 };
+    pthread_t thread;
+    u64 last;
+
+    assert(ringbuf_lanes_init(&lanes, attrs, 3, 8 * 4096, RB_DRAIN_PRIORITY) == 0);
+
+    // 批量lane写满自有的page及共享的page
+    for (nr_bulk = 0; ringbuf_lanes_write(&lanes, 1, sizeof(nr_bulk), &nr_bulk) == 0; nr_bulk++)
+        ;
+    assert(lanes.nr_dropped[1] == 1);
+    assert(lanes.lanes[1]->nr_page > lanes.lanes[1]->min_page);
+    assert(lanes.pool.nr_free == 0);
+
+    // 积压之后写入的控制记录先被读到
+    data = 0xc0;
+    assert(ringbuf_lanes_write(&lanes, 0, sizeof(data), &data) == 0);
+    assert(ringbuf_lanes_consume(&lanes, &entry, &lane) && lane == 0);
+    assert(*(u32 *)entry.data == 0xc0);
+
+    // DROP_OLD: 写入比lane能容纳的更多的记录, 只保留最新的
+    for (n = 0; n < 10000; n++)
+        assert(ringbuf_lanes_write(&lanes, 2, sizeof(n), &n) == 0);
+    assert(lanes.nr_dropped[2] > 0);
+    assert(lanes.nr_dropped[2] + lanes.lanes[2]->nr_entry -
+            lanes.lanes[2]->nr_read == 10000);
+    expect = lanes.nr_dropped[2];
+
+    // 加权轮询: 每轮lane 0读1条, lane 1读3条, lane 2读1条
+    lanes.drain = RB_DRAIN_WEIGHTED;
+    for (n = 0; n < 4; n++) {
+        data = n;
+        assert(ringbuf_lanes_write(&lanes, 0, sizeof(data), &data) == 0);
+    }
+    for (n = 0; n < 20; n++) {
+        assert(ringbuf_lanes_consume(&lanes, &entry, &lane));
+        seen[lane]++;
+        if (lane == 2)
+            assert(*(u32 *)entry.data == expect++);
+        // 控制记录在一轮之内被读到
+        if (n % 5 == 4)
+            assert(seen[0] == n / 5 + 1 && seen[1] == (n / 5 + 1) * 3);
+    }
+
+    // 读完所有lane, 借用的page都归还
+    while (ringbuf_lanes_consume(&lanes, &entry, &lane)) {
+        seen[lane]++;
+        if (lane == 2)
+            assert(*(u32 *)entry.data == expect++);
+    }
+    assert(seen[0] == 4 && seen[1] == nr_bulk && expect == 10000);
+    assert(lanes.pool.nr_free > 0);
+    printf("lanes: %u bulk records queued, %llu old records dropped\n", nr_bulk,
+            (unsigned long long)lanes.nr_dropped[2]);
+
+    // DROP_OLD的writer在另一个线程中: 读到的序号递增, 读到的与丢弃的
+    // 记录数之和等于写入的记录数. 记录的内容可能已被覆盖, 只检查entry
+    assert(pthread_create(&thread, NULL, lanes_writer, &lanes) == 0);
+    last = lanes.lanes[2]->nr_read;
+    expect = lanes.nr_dropped[2];
+    for (n = 0; n + __atomic_load_n(&lanes.nr_dropped[2], __ATOMIC_RELAXED) -
+            expect < LANE_RECORDS; ) {
+        if (!ringbuf_lanes_consume(&lanes, &entry, &lane)) {
+            sched_yield();
+            continue;
+        }
+        assert(lane == 2 && entry.seq >= last);
+        last = entry.seq + 1;
+        n++;
+    }
+    pthread_join(thread, NULL);
+    assert(!ringbuf_lanes_consume(&lanes, &entry, &lane));
+    ringbuf_lanes_destroy(&lanes);
+}
+
+/*
+ * max_age: 最新记录也早于时间窗口的page在读取时整页跳过,
+ * 使用pool的buffer通过 ringbuf_expire() 尽早归还过期的page.
+ */
+static u32 nr_clock_read;
+static u64 counting_clock(void)
+{
+    nr_clock_read++;
+    return fake_now;
+}
+
+static void test_retention(void)
+{
+    struct ringbuf_attr attr = {
+        .flags = RB_FL_TIMESTAMP, .clock = fake_clock, .max_age = 1000,
+    };
+    struct ringbuf_pool pool;
+    struct ringbuf_entry entry;
+    struct ringbuf_iter iter;
+    struct ringbuf *buffer;
+    static u8 data[1000];
+    u32 nr_free, nr_page, n;
+
+    assert(ringbuf_pool_init(&pool, 8) == 0);
+    attr.pool = &pool;
+    buffer = ringbuf_alloc_attr(2 * 4096, &attr);
+
+    // 每个page大约3条记录, 第n条记录的时间为n*100
+    for (n = 0; n < 30; n++) {
+        fake_now = n * 100;
+        assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    }
+    assert(buffer->nr_page > buffer->min_page);
+    nr_free = pool.nr_free;
+
+    // 窗口为[1900, 2900]: 只有最新记录不早于1900的page可见
+    fake_now = 2900;
+    ringbuf_iter_start(&iter, buffer);
+    assert(ringbuf_iter_next(&iter, &entry) && entry.ts <= 1900);
+    assert(buffer->nr_expired > 0 && buffer->nr_expired <= 19);
+    assert(pool.nr_free > nr_free);
+    assert(ringbuf_consume_entry(buffer, &entry));
+    for (n = 1; ringbuf_consume_entry(buffer, &entry); n++)
+        assert(entry.ts >= 1000);
+    assert(buffer->nr_expired + n == 30);
+
+    // 时间窗口之外的记录一条都读不到
+    for (n = 0; n < 30; n++) {
+        fake_now = 10000 + n * 100;
+        assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    }
+    fake_now = 100000;
+    assert(ringbuf_expire(buffer) == 30);
+    assert(!ringbuf_consume_entry(buffer, &entry));
+    printf("retention: %llu records expired\n", (unsigned long long)buffer->nr_expired);
+    ringbuf_free(buffer);
+
+    // 读取时只在换入page时读时钟, 而不是每条记录一次
+    attr.clock = counting_clock;
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    for (n = 0; ringbuf_write(buffer, 8, data) == 0; n++)
+        ;
+    nr_page = buffer->nr_page;
+    nr_clock_read = 0;
+    while (ringbuf_consume_entry(buffer, &entry))
+        n--;
+    assert(n == 0 && nr_clock_read <= nr_page);
+
+    ringbuf_free(buffer);
+    ringbuf_pool_destroy(&pool);
+}
+
+/*
+ * RB_FL_SAMPLE: 没有reader时buffer逐渐写满, 填充率超过start后批量记录(type 1)
+ * 按越来越高的采样率保留, 控制记录(type 0)从不采样. 按 entry.rate 还原的
+ * 批量记录数与实际写入的数量接近.
+ */
+static void test_sampling(void)
+{
+    static struct ringbuf_sampling smp = { .start = 50, .step = 10 };
+    struct ringbuf_attr attr = { .flags = RB_FL_SAMPLE, .sampling = &smp };
+    struct ringbuf_entry entry;
+    struct ringbuf *buffer;
+    u32 data[4] = { 0 };
+    u64 nr_bulk = 0, nr_ctl = 0, scaled = 0, max_rate = 0, lost = 0, out;
+
+    smp.max_rate[1] = 64;
+    buffer = ringbuf_alloc_attr(8 * 4096, &attr);
+    for (;;) {
+        if (ringbuf_write_type(buffer, 0, sizeof(data), data))
+            break;
+        nr_ctl++;
+        for (int i = 0; i < 10; i++, nr_bulk++) {
+            out = buffer->nr_sampled_out;
+            // 采样保留了但buffer已满, 它代表的记录都丢失了
+            if (ringbuf_write_type(buffer, 1, sizeof(data), data) &&
+                    buffer->nr_sampled_out == out)
+                lost += MIN(1u << buffer->sample_shift, 64);
+        }
+    }
+    assert(buffer->nr_sampled_out > 0);
+    assert(buffer->nr_entry + buffer->nr_sampled_out + 1 >= nr_ctl + nr_bulk);
+
+    while (ringbuf_consume_entry(buffer, &entry)) {
+        if (entry.type == 0) {
+            assert(entry.rate == 1);
+            nr_ctl--;
+            continue;
+        }
+        scaled += entry.rate;
+        max_rate = entry.rate > max_rate ? entry.rate : max_rate;
+    }
+    assert(nr_ctl == 0 && max_rate == 64);
+    // 采样率只升不降, 每条保留的记录恰好代表rate条记录, 包括page开头的记录
+    assert(scaled + lost + buffer->sample_seen[1] == nr_bulk);
+    printf("sampling: %llu bulk records written, %llu estimated, %llu sampled out\n",
+            (unsigned long long)nr_bulk, (unsigned long long)scaled,
+            (unsigned long long)buffer->nr_sampled_out);
+    ringbuf_free(buffer);
+}
+
+/*
+ * history: reader读完的page被压缩保存, ringbuf_iter_history() 从history中
+ * 最旧的page遍历到环中最新的记录, 序号连续.
+ */
+struct hist_record {
+    u64 seq;
+    u32 cpu;
+    u32 event;
+    char comm[16];
+};
+
+static void check_history(struct ringbuf *buffer, u64 last)
+{
+    struct ringbuf_entry entry;
+    struct ringbuf_iter iter;
+    struct hist_record *rec;
+    u64 first, n = 0;
+
+    ringbuf_iter_history(&iter, buffer);
+    assert(ringbuf_iter_next(&iter, &entry));
+    first = entry.seq;
+    do {
+        rec = entry.data;
+        assert(entry.seq == first + n && rec->seq == entry.seq);
+        n++;
+    } while (ringbuf_iter_next(&iter, &entry));
+    assert(first + n == last);
+}
+
+static void test_history(void)
+{
+    struct ringbuf_attr attr = { .history = 4 * 4096 };
+    struct ringbuf_entry entry, first;
+    struct ringbuf_iter iter;
+    struct hist_record rec = { .comm = "kworker/0:1" };
+    struct ringbuf *buffer, *spare;
+    u8 noise[64];
+    u64 n;
+
+    buffer = ringbuf_alloc_attr(4 * 4096, &attr);
+    for (n = 0; n < 4000; n++) {
+        rec.seq = n;
+        rec.cpu = n % 4;
+        rec.event = n % 7;
+        assert(ringbuf_write(buffer, sizeof(rec), &rec) == 0);
+        if (n % 100 == 99)
+            while (ringbuf_consume_entry(buffer, &entry))
+                ;
+    }
+    // 早于history的记录已被丢弃, 可以看到的记录远多于环的容量
+    assert(buffer->hist_head > 0);
+    assert(buffer->hist_raw > 2 * (buffer->hist_tail - buffer->hist_head));
+    assert(buffer->nr_hist > buffer->nr_page);
+    check_history(buffer, n);
+    printf("history: %u pages, %llu -> %llu bytes\n", buffer->nr_hist,
+            (unsigned long long)buffer->hist_raw,
+            (unsigned long long)(buffer->hist_tail - buffer->hist_head));
+
+    // 不可压缩的page原样保存
+    for (; n < 4400; n++) {
+        rec.seq = n;
+        for (u32 i = 0; i < sizeof(noise); i++)
+            noise[i] = rand();
+        memcpy(noise, &rec, sizeof(rec.seq));
+        assert(ringbuf_write(buffer, sizeof(noise), noise) == 0);
+        while (ringbuf_consume_entry(buffer, &entry))
+            ;
+    }
+    check_history(buffer, n);
+
+    // 遍历history期间reader继续消费, 已返回的记录不会被压缩新page覆盖
+    ringbuf_iter_history(&iter, buffer);
+    assert(ringbuf_iter_next(&iter, &first));
+    rec.seq = *(u64 *)first.data;
+    for (u64 i = 0; i < 400; i++, n++) {
+        memcpy(noise, &n, sizeof(n));
+        assert(ringbuf_write(buffer, sizeof(noise), noise) == 0);
+        while (ringbuf_consume_entry(buffer, &entry))
+            ;
+    }
+    assert(*(u64 *)first.data == rec.seq && first.seq == rec.seq);
+    while (ringbuf_iter_next(&iter, &entry))
+        assert(*(u64 *)entry.data == entry.seq && entry.seq > rec.seq);
+    assert(entry.seq == n - 1);
+
+    // snapshot连同history一起冻结
+    spare = ringbuf_alloc_snapshot(buffer);
+    ringbuf_snapshot(buffer, spare);
+    assert(spare->nr_hist > 0 && buffer->nr_hist == 0);
+    check_history(spare, n);
+
+    ringbuf_free(spare);
+    ringbuf_free(buffer);
+}
+
+/*
+ * ringbuf_consume_hold(): 持有的记录在释放前不会被writer覆盖,
+ * writer到达被持有的page时写入失败, 全部释放后恢复.
+ */
+static void test_hold(void)
+{
+    static struct ringbuf_entry held[256];
+    struct ringbuf_entry entry;
+    struct ringbuf *buffer;
+    u32 data[64], n, nr_held = 0, nr_free, nr_write;
+
+    buffer = ringbuf_alloc(4 * 4096);
+    for (n = 0; ; n++) {
+        data[0] = n;
+        if (ringbuf_write(buffer, sizeof(data), data))
+            break;
+    }
+    nr_free = n;
+
+    // 持有第一个page上的记录, 其余的正常消费
+    while (ringbuf_consume_hold(buffer, &entry) > 0) {
+        held[nr_held++] = entry;
+        if (entry.page != held[0].page)
+            break;
+    }
+    ringbuf_release(buffer, &held[--nr_held]);
+    while (ringbuf_consume_entry(buffer, &entry))
+        ;
+
+    // 被持有的page上的记录没有被新写入的记录覆盖
+    data[0] = ~0u;
+    for (nr_write = 0; !ringbuf_write(buffer, sizeof(data), data); nr_write++)
+        ;
+    assert(nr_write > 0 && nr_write <= nr_free - nr_held);
+    for (n = 0; n < nr_held; n++)
+        assert(*(u32 *)held[n].data == held[n].seq);
+
+    for (n = 0; n < nr_held; n++)
+        ringbuf_release(buffer, &held[n]);
+    while (ringbuf_consume_entry(buffer, &entry))
+        ;
+    for (n = 0; !ringbuf_write(buffer, sizeof(data), data); n++)
+        ;
+    assert(n == nr_free);
+    printf("hold: %u records held, %u of %u records writable meanwhile\n",
+            nr_held, nr_write, nr_free);
+    ringbuf_free(buffer);
+
+    // 被持有的page放回环中后, 跨page的记录同样不能写入, 写入失败而不是写到一半
+    static u8 big[6000];
+    buffer = ringbuf_alloc(4 * 4096);
+    for (n = 0; n < 16; n++) {
+        data[0] = n;
+        assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    }
+    assert(ringbuf_consume_hold(buffer, &held[0]) == 1);
+    while (ringbuf_consume_entry(buffer, &entry))
+        ;
+    for (nr_write = 0; !ringbuf_write(buffer, sizeof(big), big); nr_write++)
+        ;
+    assert(nr_write > 0 && *(u32 *)held[0].data == 0);
+    for (n = 0; n < nr_write; n++)
+        assert(ringbuf_consume_copy(buffer, big, sizeof(big)) == sizeof(big));
+    ringbuf_release(buffer, &held[0]);
+    assert(ringbuf_write(buffer, sizeof(big), big) == 0);
+    ringbuf_free(buffer);
+
+    // 跨page的记录不能被持有, 返回-1且不消费, 取出后可以继续持有之后的记录
+    buffer = ringbuf_alloc(4 * 4096);
+    for (n = 0; n < 3; n++) {
+        data[0] = n;
+        assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    }
+    memset(big, 0xab, sizeof(big));
+    assert(ringbuf_write(buffer, sizeof(big), big) == 0);
+    data[0] = 4;
+    assert(ringbuf_write(buffer, sizeof(data), data) == 0);
+    for (n = 0; n < 3; n++)
+        assert(ringbuf_consume_hold(buffer, &held[n]) == 1);
+    assert(ringbuf_consume_hold(buffer, &entry) == -1);
+    assert(ringbuf_consume_hold(buffer, &entry) == -1);
+    memset(big, 0, sizeof(big));
+    assert(ringbuf_consume_copy(buffer, big, sizeof(big)) == sizeof(big));
+    assert(big[0] == 0xab && big[sizeof(big) - 1] == 0xab);
+    assert(ringbuf_consume_hold(buffer, &held[3]) == 1);
+    assert(held[3].seq == 4 && *(u32 *)held[3].data == 4);
+    assert(ringbuf_consume_hold(buffer, &entry) == 0);
+    for (n = 0; n < 4; n++)
+        ringbuf_release(buffer, &held[n]);
+    ringbuf_free(buffer);
+}
+
 int main()
 {
     struct ringbuf *buffer;
@@ -46,5 +1324,28 @@ int main()
     }
 
     ringbuf_show_state(buffer);
+
+    test_large_record();
+    test_align();
+    test_fixed_record();
+    test_compact();
+    test_seek();
+    test_filter();
+    test_snapshot();
+    test_trigger();
+    test_merge();
+    test_save();
+    test_flush();
+    test_crc();
+    test_pool();
+    test_lazy();
+    test_mirror();
+    test_copy();
+    test_latency();
+    test_lanes();
+    test_retention();
+    test_sampling();
+    test_history();
+    test_hold();
     return 0;
 }
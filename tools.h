@@ -23,6 +23,8 @@
 
 
 #define ALIGN_UP(X, align)   (((X) + ((align) - 1)) & ~((align) - 1))
+#define ALIGN_DOWN(X, align) ((X) & ~((align) - 1))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
 